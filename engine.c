@@ -1,14 +1,69 @@
+#define _GNU_SOURCE //memfd_create
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
+#include <unistd.h>
+#include <stddef.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "SDL.h"
-#include "SDL_ttf.h"
+#include <cairo.h>
 
 #define WIDTH 1280
 #define HEIGHT 720
 #define focal_length 5000.0
 #define padding_left 640
 #define padding_bottom 0
+#define near_plane 1.0
+#define MAX_PYRAMID_LEVELS 16
+#define OCCLUSION_BIAS 0.001 //Relative inverse depth slack for float rounding in the pyramid
+#define EDGE_BIAS 0.01 //Relative slack that lets edges win the depth test against their own faces
+#define MAX_LIGHTS 8
+#define RAY_CANDIDATES 32 //Mesh boxes cast_ray keeps on the stack before it allocates
+#define VERTEX_CACHE_SIZE 32 //Post-transform cache modelled by optimize_mesh and mesh_acmr
+#define MAX_MIP_LEVELS 11
+#define MAX_TEXTURE_SIZE 1024 //1 << (MAX_MIP_LEVELS - 1)
+
+#define CHUNK_SIZE 2000.0 //World units per streaming cell, on the x/z plane
+#define CHUNK_RADIUS 2 //Cells kept loaded around the camera in each direction
+#define CHUNK_KEEP_RADIUS 4 //Farther resident cells are dropped even when the budget has room
+#define CHUNK_MAGIC 0x4b4e4843 //"CHNK"
+#define MAX_PENDING_CHUNKS 256
+
+#define CAPTURE_MAGIC 0x50414346 //"FCAP"
+#define CAPTURE_DATA_OFFSET 4096 //Header gets its own page, slots start page aligned
+#define CAPTURE_SLOT_HEADER 64 //CaptureSlot padded so pixel rows stay cache line aligned
+
+#define SNAPSHOT_MAGIC 0x50414e53 //"SNAP"
+#define SNAPSHOT_VERSION 1
+
+#define MEMORY_GEOMETRY 0 //Worlds, meshes, polygons and everything that builds them
+#define MEMORY_FRAME 1 //Per-frame scratch: framebuffers, transformed vertices, lighting caches
+#define MEMORY_TEXTURE 2
+#define MEMORY_HUD 3
+#define MEMORY_OTHER 4 //Scene, camera path, batch and capture bookkeeping
+#define MEMORY_CATEGORIES 5
+#define MEMORY_MAGIC 0x4d454d45 //"EMEM"
+
+#define LATENCY_BUCKETS 100 //1 ms each, the last one also takes everything slower
+#define MAX_PENDING_INPUT 64 //Input events remembered per frame for latency measurement
+
+#define CHUNK_QUEUED 0
+#define CHUNK_READY 1 //Loaded by the I/O thread, waiting for the render thread
+#define CHUNK_RESIDENT 2
+
+#define SHADE_FLAT 0
+#define SHADE_GOURAUD 1
+
+#define LIGHT_DIRECTIONAL 0
+#define LIGHT_POINT 1
 
 //For movement, do not change translations of points, change camera/padding
 
@@ -18,41 +73,510 @@ typedef struct Vector3 {
     double z;
 } Vector3;
 
+//Single precision for per-frame data, where a million vertices of doubles would cost more than the source
+typedef struct Vector3f {
+    float x;
+    float y;
+    float z;
+} Vector3f;
+
+//Per-frame results for one pool vertex, 40 bytes. Source positions live on the mesh, see Mesh.positions and Mesh.packed.
 typedef struct Vertex {
-    Vector3 absolute_position;
-    Vector3 local_transform;
-    Vector3 perspective;
+    Vector3f local_transform;
+    Vector3f perspective;
+    int screen_x; //Projected once per frame by project_mesh
+    int screen_y;
+    float inv_depth; //1/depth, nearer is larger
+    int in_front; //0 if the vertex is behind the near plane
 } Vertex;
 
+//Square, power of two, with a full mip chain. Every level is stored in Morton (Z) order
+//so texels that are close in u and v are close in memory too.
+typedef struct Texture {
+    Uint32* levels[MAX_MIP_LEVELS]; //ARGB8888
+    int sizes[MAX_MIP_LEVELS];
+    int num_levels;
+} Texture;
+
+//Compact source vertex: position quantized to 16 bits per axis inside the mesh bounds,
+//normal octahedral-encoded in two bytes. 8 bytes against 24 for the double position alone.
+typedef struct PackedVertex {
+    Uint16 x;
+    Uint16 y;
+    Uint16 z;
+    Uint8 normal[2];
+} PackedVertex;
+
 typedef struct Polygon {
-    Vertex* sequence;
+    Vector3* sequence; //Build-time positions, moved into the mesh pool by add_polygon
+    int* indices; //Indices into the owning mesh's vertex pool
+    float* uvs; //u, v per corner. Welded vertices are shared between faces, texture coordinates are not
     int num_vertices;
     int vertices_added;
-    SDL_Color color;
+    SDL_Color color; //Tints the texture if there is one
+    Texture* texture; //NULL for solid color, not owned by the polygon
 } Polygon;
 
+typedef struct Light {
+    int type; //LIGHT_DIRECTIONAL or LIGHT_POINT
+    Vector3 vector; //Direction the light travels, or its position for point lights
+    double intensity;
+} Light;
+
+//One node of the flattened scene graph. Parents always sit at a lower index than their
+//children, so world transforms are resolved in a single forward pass with no recursion.
+typedef struct TransformNode {
+    int parent; //-1 for a root
+    Vector3 translation; //Local transform: rotate about pivot, then translate, in the parent's space
+    Vector3 rotation;
+    Vector3 pivot;
+    double local[3][3]; //Cached from rotation, only rebuilt when the node itself is dirty
+    Vector3 local_offset;
+    double world[3][3]; //Resolved by update_scene_graph
+    Vector3 world_translation;
+    int version; //Bumped every time world changes, meshes compare it to skip re-rotating
+    int dirty; //Local transform edited since the last update
+    int updated; //World transform recomputed during the current update pass
+} TransformNode;
+
+typedef struct SceneGraph {
+    TransformNode* nodes;
+    int num_nodes; //Capacity
+    int nodes_added;
+    int first_dirty; //Lowest node whose local transform changed, nodes_added when clean
+} SceneGraph;
+
+typedef struct Edge {
+    int a; //Vertex pool indices, a < b
+    int b;
+} Edge;
+
 typedef struct Mesh {
     Polygon** polygons; //List of pointers to polygons
     int num_polygons;
     int polygons_added;
+    Vector3* positions; //Source positions of the shared vertex pool, NULL once the mesh is packed
+    PackedVertex* packed; //Compact source data from compress_mesh, NULL for full precision meshes
+    Vector3 quant_scale; //position = bounds_min + packed*quant_scale
+    Vertex* vertices; //Per-frame results for the pool, each unique position is transformed once
+    int num_vertices; //Capacity of positions, the welded count once built
+    int vertices_added;
+    Edge* edges; //Unique edges, filled in by build_mesh
+    int num_edges;
+    int built;
     int re_render;
+    int occluded; //Set by the hierarchical Z test, skips transform and raster for this frame
+    double drawn_nearest; //Nearest inverse depth the mesh could have written last frame, 0 if it wasn't drawn
+    int transform_valid; //local_transform matches applied_rotation, rotate_mesh can skip the work
+    Vector3 applied_rotation;
+    int node; //Scene graph node this mesh hangs off, -1 for none
+    int applied_node_version;
+    int cached_valid; //cached_transform/cached_offset are mesh_transform for cached_rotation and cached_node_version
+    double cached_transform[3][3];
+    Vector3 cached_offset;
+    Vector3 cached_rotation;
+    int cached_node_version;
+    Vector3 cached_sphere_center; //Bounding box's enclosing sphere under cached_transform, for cheap ray rejects
+    double cached_sphere_radius;
+    Vector3 transformed_center; //center after the mesh and node transforms
+    float* face_light; //Lighting term per polygon, cached until the mesh rotates or the lights change
+    float* vertex_light; //Lighting term per pool vertex, for Gouraud
+    int lit_version; //world->lights_version the cache was computed against, -1 when stale
+    Vector3 bounds_min; //Bounding box of absolute positions, filled in by build_mesh
+    Vector3 bounds_max;
     Vector3 center;
     Vector3 rotation;
+    Uint8* mapping; //Snapshot the mesh was loaded from, arrays inside it belong to the mapping, not malloc
+    size_t mapping_size;
 } Mesh;
 
+//Min-reduced copies of the depth buffer, level 0 is half resolution.
+//Each texel holds the farthest (smallest) inverse depth of the pixels under it.
+typedef struct DepthPyramid {
+    float* levels[MAX_PYRAMID_LEVELS];
+    int widths[MAX_PYRAMID_LEVELS];
+    int heights[MAX_PYRAMID_LEVELS];
+    int num_levels;
+    int valid; //0 until the first frame has been reduced into it
+} DepthPyramid;
+
+//A translucent polygon waiting for the back to front pass at the end of render_world
+typedef struct TransparentPolygon {
+    Uint32 key; //Sorts farthest first, see render_mesh
+    int index;
+    Mesh* mesh;
+} TransparentPolygon;
+
 typedef struct World {
     Mesh** meshes; //List of pointers to meshes
     int num_meshes;
     int meshes_added;
+    int wireframe; //Draw only the unique edge lists, skip polygon fill
+    DepthPyramid* occlusion; //Previous frame's depth, NULL disables occlusion culling
+    int meshes_culled; //Meshes rejected by the last rotate_all_in_world
+    Light lights[MAX_LIGHTS];
+    int num_lights;
+    int lights_version; //Bump after editing lights so every mesh relights once
+    double ambient;
+    int shading; //SHADE_FLAT or SHADE_GOURAUD
+    SceneGraph graph;
+    SDL_mutex* lock; //Held while meshes or transforms change, so ray queries from other threads see a whole frame
+    SDL_atomic_t ray_readers; //cast_ray calls scanning meshes outside lock, meshes taken out of the world wait for 0 before being freed
+    TransparentPolygon* transparent; //Collected by render_mesh each frame
+    TransparentPolygon* transparent_sorted; //Radix sort scratch, same capacity
+    int num_transparent; //Capacity
+    int transparent_added;
+    float* light_scratch; //SoA normals and positions for light_mesh, grows to the largest mesh and stays
+    int light_scratch_size; //Capacity in floats
+    Uint8* snapshot; //Mapping from load_snapshot, NULL for worlds built in memory. Released by free_world.
+    size_t snapshot_size;
 } World;
 
-typedef struct RowBucket {
-    int xvalues[5]; //Sorta dymanic arr going here
-    int size;
-} RowBucket;
+//Result of cast_ray. mesh is NULL when nothing was hit.
+typedef struct RayHit {
+    Mesh* mesh;
+    int polygon; //Index into mesh->polygons
+    double distance; //Along the normalized ray
+    Vector3 point; //In local_transform space
+} RayHit;
+
+//A mesh whose box a ray crosses, with the ray already in the mesh's source space
+typedef struct RayCandidate {
+    Mesh* mesh;
+    Vector3 origin;
+    Vector3 direction;
+    double entry; //Distance the ray enters the box at
+} RayCandidate;
+
+//Up to four fan triangles in SoA layout for intersect_triangles
+typedef struct TriangleBatch {
+    float v0[3][4];
+    float e1[3][4]; //v1 - v0
+    float e2[3][4]; //v2 - v0
+    int polygon[4];
+    int count;
+} TriangleBatch;
+
+//One streaming cell. Only the I/O thread touches meshes while the chunk is CHUNK_QUEUED,
+//only the render thread once it is CHUNK_READY or CHUNK_RESIDENT.
+typedef struct Chunk {
+    int cx;
+    int cz;
+    int state;
+    Mesh** meshes;
+    int num_meshes;
+    size_t bytes; //Resident size of the meshes, counted against the streamer budget
+} Chunk;
+
+typedef struct ChunkStreamer {
+    char* directory; //Holds chunk_<cx>_<cz>.bin files
+    size_t budget; //Bytes of chunk geometry allowed to stay resident
+    size_t resident_bytes;
+    Chunk** chunks; //Every chunk the render thread knows about, in any state
+    int num_chunks;
+    int chunks_added;
+    //Shared with the I/O thread, guarded by lock
+    SDL_mutex* lock;
+    SDL_cond* wake;
+    SDL_Thread* thread;
+    Chunk* requests[MAX_PENDING_CHUNKS];
+    int num_requests;
+    Chunk* completed[MAX_PENDING_CHUNKS];
+    int num_completed;
+    int quit;
+} ChunkStreamer;
+
+typedef struct Framebuffer {
+    Uint32* pixels; //ARGB8888, row-major, width*height
+    float* depth; //Inverse depth per pixel, 0 is infinitely far
+    Uint32* span_pixels; //One row of source colors for a translucent span, composited by blend_span
+    float* span_depth; //Where translucent spans send their depth writes, never read
+    int width;
+    int height;
+} Framebuffer;
+
+typedef struct RasterVertex {
+    float x;
+    float y;
+    float inv_z; //Interpolates linearly in screen space
+    float r; //Gouraud color, or the texture tint
+    float g;
+    float b;
+    float u_z; //u/z and v/z, divided by inv_z per pixel for perspective correct texturing
+    float v_z;
+} RasterVertex;
+
+//Per polygon inputs to fill_triangle
+typedef struct RasterState {
+    Uint32 color; //Flat color when untextured
+    int shading;
+    Uint32* texels; //Chosen mip level, NULL for solid color
+    int texture_size;
+    int alpha; //0-255 from the polygon color, below 255 blends and skips the depth write
+} RasterState;
+
+//The built-in scene, shared by the interactive loop and batch mode
+typedef struct DemoScene {
+    World* world;
+    int shape; //Scene graph node the six cubes turn about
+    Mesh* spinner; //Textured cube that also tumbles on its own
+    Texture* checker;
+} DemoScene;
+
+//Camera state at one frame of a batch render, same meaning as the interactive subject translation/rotation
+typedef struct CameraKey {
+    int frame;
+    Vector3 translation;
+    Vector3 rotation;
+} CameraKey;
+
+typedef struct CameraPath {
+    CameraKey* keys; //Sorted by frame, linearly interpolated in between
+    int num_keys;
+    int keys_added;
+} CameraPath;
+
+//One entry of the batch reorder window. Frame f always lands in slot f % window.
+typedef struct BatchSlot {
+    Uint32* pixels; //Swapped with the worker's framebuffer, never copied
+    Uint8* yuv; //Y, U, V planes for y4m output, NULL when writing images
+    int ready;
+} BatchSlot;
+
+typedef struct BatchRenderer {
+    CameraPath* path;
+    char* chunk_directory; //NULL for just the demo scene
+    size_t chunk_budget; //Per worker, the --chunk-budget total split between them
+    int end_frame; //One past the last key
+    int window; //Frames allowed in flight past the next one to be written
+    BatchSlot* slots;
+    //Guarded by lock
+    SDL_mutex* lock;
+    SDL_cond* changed;
+    int next_frame; //Next frame a worker will claim
+    int next_write; //Next frame the writer is waiting on
+} BatchRenderer;
+
+//Each worker renders whole frames into its own copy of the scene, nothing is shared but the window
+typedef struct BatchWorker {
+    BatchRenderer* batch;
+    DemoScene* scene;
+    Framebuffer* fb;
+    ChunkStreamer* streamer;
+    SDL_Thread* thread;
+} BatchWorker;
+
+//Start of the capture mapping. An encoder maps the same memory and reads slots read_sequence up to
+//write_sequence - 1 (slot = sequence % num_slots), bumping read_sequence as it finishes each one.
+typedef struct CaptureHeader {
+    Uint32 magic; //CAPTURE_MAGIC
+    Uint32 width;
+    Uint32 height;
+    Uint32 stride; //Bytes per pixel row, pixels are ARGB8888
+    Uint32 num_slots;
+    Uint32 slot_bytes; //Distance between slots: a CaptureSlot padded to CAPTURE_SLOT_HEADER, then the pixels
+    Uint32 data_offset; //First slot, from the start of the mapping
+    SDL_atomic_t write_sequence; //Frames published by the engine
+    SDL_atomic_t read_sequence; //Frames released by the consumer
+    SDL_atomic_t dropped; //Frames rendered while the ring was full, never published
+} CaptureHeader;
+
+typedef struct CaptureSlot {
+    Uint32 frame; //Engine frame number, gaps mean drops
+    Uint32 ticks; //SDL_GetTicks when published
+} CaptureSlot;
+
+//Input to present times, filled in by the game loop with --latency
+typedef struct LatencyHistogram {
+    int counts[LATENCY_BUCKETS];
+    int samples;
+    Uint32 max;
+    double total;
+} LatencyHistogram;
+
+typedef struct OverlayElement OverlayElement;
+typedef void (*OverlayDrawFunction)(cairo_t* cr, OverlayElement* element);
+
+//One piece of the HUD. Its content is drawn once into a cached cairo surface and only redrawn
+//when marked dirty, every other frame just composites the cached pixels.
+struct OverlayElement {
+    int x; //Top left on screen
+    int y;
+    int width; //Of the cached surface
+    int height;
+    cairo_surface_t* surface; //ARGB32 with premultiplied alpha, same layout as the framebuffer pixels
+    unsigned char* pixels; //The surface's memory, ours so it counts as MEMORY_HUD
+    OverlayDrawFunction draw; //Draws the content with (0, 0) at the surface's top left
+    void* data; //For draw functions that need more than the fields below
+    char text[256]; //Labels only
+    double font_size;
+    double color[3];
+    int dirty; //Set whenever the content changes, cleared by the redraw
+    int visible;
+    int redraws; //How often draw actually ran
+};
+
+typedef struct Overlay {
+    OverlayElement** elements; //Composited in order, later ones on top
+    int num_elements;
+    int elements_added;
+} Overlay;
+
+//Frames are rendered straight into the ring, so capture costs no copies on the engine side
+typedef struct CaptureRing {
+    CaptureHeader* header;
+    size_t size; //Of the whole mapping
+    int fd; //memfd, -1 when the ring is plain heap memory
+    Uint32* own_pixels; //The framebuffer's own buffer, rendered into while the ring is full
+    int acquired; //Slot handed out for the current frame, -1 if this frame isn't captured
+    Uint32 frame;
+} CaptureRing;
+
+//Every engine_malloc block starts with this. 16 bytes, so the caller's memory keeps malloc's alignment.
+typedef struct MemoryBlock {
+    Uint64 bytes; //Asked for by the caller, without this header
+    Uint32 category; //MEMORY_GEOMETRY, ...
+    Uint32 magic; //MEMORY_MAGIC while the block is live
+} MemoryBlock;
+
+typedef struct MemoryStats {
+    size_t bytes[MEMORY_CATEGORIES]; //Live right now
+    size_t peak_bytes[MEMORY_CATEGORIES];
+    int allocations[MEMORY_CATEGORIES]; //Live right now
+    Uint64 total_allocations[MEMORY_CATEGORIES]; //Ever made, the difference between two reads is the churn
+    int worlds; //Created and not yet freed
+} MemoryStats;
+
+//Start of a snapshot file. The rest is the World, its meshes, polygons and textures stored as the structs
+//themselves, with every pointer written as an offset from the start of the file. The relocation table
+//lists where those pointers are, load_snapshot adds the mapping address to each and the world is ready.
+typedef struct SnapshotHeader {
+    Uint32 magic; //SNAPSHOT_MAGIC
+    Uint32 version;
+    Uint32 pointer_size; //Native layout like chunk files, only loads on the same kind of machine
+    Uint32 layout; //Sum of the struct sizes, catches a struct change without a version bump
+    Uint32 user[4]; //Saved as given, the demo keeps its spinner mesh and shape node here
+    Uint64 size; //Of the whole file
+    Uint64 world; //Offset of the World
+    Uint64 relocations; //Offset of the table, one Uint64 file offset per pointer
+    Uint64 num_relocations;
+} SnapshotHeader;
+
+typedef struct SnapshotWriter {
+    Uint8* data; //The file so far, pointers in it are still offsets
+    size_t size;
+    size_t capacity;
+    Uint64* relocations;
+    size_t num_relocations; //Capacity
+    size_t relocations_added;
+    Texture** textures; //Already written, shared textures are stored once
+    size_t* texture_offsets;
+    int num_textures; //Capacity
+    int textures_added;
+} SnapshotWriter;
 
 void print(char* o) { printf(o); printf("\n"); }
 
+char* memory_category_names[MEMORY_CATEGORIES] = { "geometry", "frame", "texture", "hud", "other" };
+MemoryStats memory_stats; //Guarded by memory_lock, read it with get_memory_stats
+SDL_SpinLock memory_lock = 0;
+
+void count_memory(int category, Sint64 bytes, int allocations) {
+    SDL_AtomicLock(&memory_lock);
+    memory_stats.bytes[category] += bytes;
+    memory_stats.allocations[category] += allocations;
+    if (allocations > 0) { memory_stats.total_allocations[category] += allocations; }
+    if (memory_stats.bytes[category] > memory_stats.peak_bytes[category]) {
+        memory_stats.peak_bytes[category] = memory_stats.bytes[category];
+    }
+    SDL_AtomicUnlock(&memory_lock);
+}
+
+//malloc that charges the bytes to a category. Everything the engine allocates goes through here,
+//and has to go back through engine_free.
+void* engine_malloc(size_t bytes, int category) {
+    MemoryBlock* block = malloc(sizeof(MemoryBlock) + bytes);
+    if (block == NULL) { return NULL; }
+    block->bytes = bytes;
+    block->category = category;
+    block->magic = MEMORY_MAGIC;
+    count_memory(category, bytes, 1);
+    return block + 1;
+}
+
+void* engine_calloc(size_t count, size_t bytes, int category) {
+    MemoryBlock* block = calloc(1, sizeof(MemoryBlock) + count*bytes);
+    if (block == NULL) { return NULL; }
+    block->bytes = count*bytes;
+    block->category = category;
+    block->magic = MEMORY_MAGIC;
+    count_memory(category, block->bytes, 1);
+    return block + 1;
+}
+
+MemoryBlock* memory_block(void* data) {
+    MemoryBlock* block = (MemoryBlock*)data - 1;
+#ifndef NDEBUG
+    if (block->magic != MEMORY_MAGIC) {
+        fprintf(stderr, "%p wasn't allocated by engine_malloc, or was already freed\n", data);
+        abort();
+    }
+#endif
+    return block;
+}
+
+//Keeps the category the block was allocated with, category only matters when data is NULL
+void* engine_realloc(void* data, size_t bytes, int category) {
+    if (data == NULL) { return engine_malloc(bytes, category); }
+    MemoryBlock* block = memory_block(data);
+    Sint64 old_bytes = block->bytes;
+    block = realloc(block, sizeof(MemoryBlock) + bytes);
+    if (block == NULL) { return NULL; }
+    block->bytes = bytes;
+    count_memory(block->category, (Sint64)bytes - old_bytes, 0);
+    return block + 1;
+}
+
+void engine_free(void* data) {
+    if (data == NULL) { return; }
+    MemoryBlock* block = memory_block(data);
+    block->magic = 0;
+    count_memory(block->category, -(Sint64)block->bytes, -1);
+    free(block);
+}
+
+void count_world(int change) {
+    SDL_AtomicLock(&memory_lock);
+    memory_stats.worlds += change;
+    SDL_AtomicUnlock(&memory_lock);
+}
+
+void get_memory_stats(MemoryStats* stats) {
+    SDL_AtomicLock(&memory_lock);
+    *stats = memory_stats;
+    SDL_AtomicUnlock(&memory_lock);
+}
+
+//One line for the HUD, live MB per category
+void format_memory_stats(MemoryStats* stats, char* out, size_t size) {
+    int i;
+    size_t used = snprintf(out, size, "mem:");
+    for (i = 0; i < MEMORY_CATEGORIES && used < size; i++) {
+        used += snprintf(out + used, size - used, " %s %.1f MB", memory_category_names[i], stats->bytes[i]/1048576.0);
+    }
+}
+
+void print_memory_stats() {
+    MemoryStats stats;
+    get_memory_stats(&stats);
+    int i;
+    printf("%-10s %12s %8s %12s %12s\n", "memory", "live bytes", "blocks", "peak bytes", "allocations");
+    for (i = 0; i < MEMORY_CATEGORIES; i++) {
+        printf("%-10s %12zu %8d %12zu %12llu\n", memory_category_names[i], stats.bytes[i], stats.allocations[i],
+            stats.peak_bytes[i], (unsigned long long)stats.total_allocations[i]);
+    }
+}
+
 void matrix_x_matrix(double m1[][3], double m2[][3], double result[][3]) {
     int i, j, k;
     for(i = 0; i < 3; i++) {
@@ -64,13 +588,6 @@ void matrix_x_matrix(double m1[][3], double m2[][3], double result[][3]) {
     }
 }
 
-void add_to_row_bucket(RowBucket* rb, int xval) {
-    if (rb->size < 5) {
-        rb->xvalues[rb->size] = xval;
-        rb->size += 1;
-    }
-}
-
 double dot_product(double row[3], Vector3 v) {
     return row[0]*v.x + row[1]*v.y + row[2]*v.z;
 }
@@ -83,6 +600,15 @@ Vector3 matrix_x_vector(double m[][3], Vector3 v) {
     return vect;
 }
 
+//Inverse of matrix_x_vector for rotation matrices
+Vector3 matrix_transpose_x_vector(double m[][3], Vector3 v) {
+    Vector3 vect;
+    vect.x = m[0][0]*v.x + m[1][0]*v.y + m[2][0]*v.z;
+    vect.y = m[0][1]*v.x + m[1][1]*v.y + m[2][1]*v.z;
+    vect.z = m[0][2]*v.x + m[1][2]*v.y + m[2][2]*v.z;
+    return vect;
+}
+
 void print_vec(Vector3 v) {
     printf("x: %f y: %f z: %f\n", v.x, v.y, v.z);
 }
@@ -96,8 +622,11 @@ int y2d(Vector3* v, Vector3* t) {
 }
 
 Polygon* create_polygon(int num_vertices, SDL_Color* color) {
-    Polygon* poly = malloc(sizeof(Polygon));
-    poly->sequence = malloc(sizeof(Vertex)*num_vertices);
+    Polygon* poly = engine_malloc(sizeof(Polygon), MEMORY_GEOMETRY);
+    poly->sequence = engine_malloc(sizeof(Vector3)*num_vertices, MEMORY_GEOMETRY);
+    poly->indices = engine_malloc(sizeof(int)*num_vertices, MEMORY_GEOMETRY);
+    poly->uvs = engine_malloc(sizeof(float)*2*num_vertices, MEMORY_GEOMETRY);
+    poly->texture = NULL;
     poly->num_vertices = num_vertices;
     poly->vertices_added = 0;
     poly->color = *color;
@@ -105,21 +634,68 @@ Polygon* create_polygon(int num_vertices, SDL_Color* color) {
 }
 
 Mesh* create_mesh(int num_polygons) {
-    Mesh* mesh = malloc(sizeof(Mesh));
-    mesh->polygons = malloc(sizeof(Polygon*)*num_polygons);
+    Mesh* mesh = engine_malloc(sizeof(Mesh), MEMORY_GEOMETRY);
+    mesh->polygons = engine_malloc(sizeof(Polygon*)*num_polygons, MEMORY_GEOMETRY);
     mesh->num_polygons = num_polygons;
     mesh->polygons_added = 0;
+    mesh->num_vertices = num_polygons*4; //Grown by add_polygon if needed
+    mesh->positions = engine_malloc(sizeof(Vector3)*mesh->num_vertices, MEMORY_GEOMETRY);
+    mesh->packed = NULL;
+    mesh->vertices = NULL; //Allocated by build_mesh once the pool is welded
+    mesh->vertices_added = 0;
+    mesh->edges = NULL;
+    mesh->num_edges = 0;
+    mesh->built = 0;
     mesh->re_render = 1;
-    mesh->center.x = 0; mesh->center.y = 0; mesh->center.y = 0;
-    mesh->rotation.x = 0; mesh->rotation.y = 0; mesh->rotation.y = 0;
+    mesh->occluded = 0;
+    mesh->drawn_nearest = 0;
+    mesh->transform_valid = 0;
+    mesh->cached_valid = 0;
+    mesh->node = -1;
+    mesh->applied_node_version = 0;
+    mesh->face_light = NULL;
+    mesh->vertex_light = NULL;
+    mesh->lit_version = -1;
+    mesh->center.x = 0; mesh->center.y = 0; mesh->center.z = 0;
+    mesh->rotation.x = 0; mesh->rotation.y = 0; mesh->rotation.z = 0;
+    mesh->mapping = NULL;
+    mesh->mapping_size = 0;
     return mesh;
 }
 
+//Free one of a mesh's arrays, unless it lives in the snapshot the mesh was loaded from
+void free_mesh_data(Mesh* mesh, void* data) {
+    if (mesh->mapping != NULL && (Uint8*)data >= mesh->mapping && (Uint8*)data < mesh->mapping + mesh->mapping_size) { return; }
+    engine_free(data);
+}
+
 World* create_world(int num_meshes) {
-    World* world = malloc(sizeof(World));
-    world->meshes = malloc(sizeof(Mesh*)*num_meshes + 2);
+    World* world = engine_malloc(sizeof(World), MEMORY_GEOMETRY);
+    world->meshes = engine_malloc(sizeof(Mesh*)*num_meshes + 2, MEMORY_GEOMETRY);
     world->num_meshes = num_meshes;
     world->meshes_added = 0;
+    world->wireframe = 0;
+    world->occlusion = NULL;
+    world->meshes_culled = 0;
+    world->num_lights = 0;
+    world->lights_version = 0;
+    world->ambient = 1; //Unlit until a light is added
+    world->shading = SHADE_FLAT;
+    world->graph.num_nodes = 16;
+    world->graph.nodes = engine_malloc(sizeof(TransformNode)*world->graph.num_nodes, MEMORY_GEOMETRY);
+    world->graph.nodes_added = 0;
+    world->graph.first_dirty = 0;
+    world->lock = SDL_CreateMutex();
+    world->transparent = NULL;
+    world->transparent_sorted = NULL;
+    world->num_transparent = 0;
+    world->transparent_added = 0;
+    world->light_scratch = NULL;
+    world->light_scratch_size = 0;
+    SDL_AtomicSet(&(world->ray_readers), 0);
+    world->snapshot = NULL;
+    world->snapshot_size = 0;
+    count_world(1);
     int i;
     for (i = 0; i < num_meshes; i++) {
         world->meshes[i] = NULL;
@@ -127,86 +703,829 @@ World* create_world(int num_meshes) {
     return world;
 }
 
+Framebuffer* create_framebuffer(int width, int height) {
+    Framebuffer* fb = engine_malloc(sizeof(Framebuffer), MEMORY_FRAME);
+    fb->pixels = engine_malloc(sizeof(Uint32)*width*height, MEMORY_FRAME);
+    fb->depth = engine_malloc(sizeof(float)*width*height, MEMORY_FRAME);
+    fb->span_pixels = engine_malloc(sizeof(Uint32)*width, MEMORY_FRAME);
+    fb->span_depth = engine_malloc(sizeof(float)*width, MEMORY_FRAME);
+    fb->width = width;
+    fb->height = height;
+    return fb;
+}
+
+void free_framebuffer(Framebuffer* fb) {
+    engine_free(fb->pixels);
+    engine_free(fb->depth);
+    engine_free(fb->span_pixels);
+    engine_free(fb->span_depth);
+    engine_free(fb);
+}
+
+Uint32 map_color(SDL_Color color) {
+    return 0xff000000 | (color.r << 16) | (color.g << 8) | color.b;
+}
+
+void clear_framebuffer(Framebuffer* fb, Uint32 color) {
+    int i;
+    int n = fb->width*fb->height;
+    for (i = 0; i < n; i++) {
+        fb->pixels[i] = color;
+        fb->depth[i] = 0;
+    }
+}
+
+Uint32 morton_table[MAX_TEXTURE_SIZE]; //Coordinate bits spread out to every other bit
+int morton_ready = 0;
+
+//Fill morton_table. Anything that can hand a texture to the rasterizer calls it first: create_texture,
+//load_snapshot, and main at startup before any worker threads exist.
+void init_morton_table() {
+    int i, bit;
+    if (morton_ready) { return; }
+    for (i = 0; i < MAX_TEXTURE_SIZE; i++) {
+        morton_table[i] = 0;
+        for (bit = 0; bit < MAX_MIP_LEVELS; bit++) {
+            morton_table[i] |= ((i >> bit) & 1) << (2*bit);
+        }
+    }
+    morton_ready = 1;
+}
+
+Uint32 morton_index(int x, int y) {
+    return morton_table[x] | (morton_table[y] << 1);
+}
+
+//Average 2x2 blocks of a row-major level, per channel
+void downsample_level(Uint32* src, int size, Uint32* dst) {
+    int half = size/2;
+    int x, y, c;
+    Uint32 p[4], out;
+    for (y = 0; y < half; y++) {
+        for (x = 0; x < half; x++) {
+            p[0] = src[2*y*size + 2*x];
+            p[1] = src[2*y*size + 2*x + 1];
+            p[2] = src[(2*y + 1)*size + 2*x];
+            p[3] = src[(2*y + 1)*size + 2*x + 1];
+            out = 0;
+            for (c = 0; c < 32; c += 8) {
+                out |= ((((p[0] >> c) & 255) + ((p[1] >> c) & 255) + ((p[2] >> c) & 255) + ((p[3] >> c) & 255) + 2)/4) << c;
+            }
+            dst[y*half + x] = out;
+        }
+    }
+}
+
+//Build a texture from row-major ARGB8888 pixels. The image is resampled to a power of two square,
+//the mip chain is generated here once, and each level is then swizzled into Morton order.
+Texture* create_texture(Uint32* pixels, int width, int height) {
+    init_morton_table();
+    int size = 1;
+    while (size < width || size < height) { size *= 2; }
+    if (size > MAX_TEXTURE_SIZE) { size = MAX_TEXTURE_SIZE; }
+
+    Texture* texture = engine_malloc(sizeof(Texture), MEMORY_TEXTURE);
+    Uint32* linear = engine_malloc(sizeof(Uint32)*size*size, MEMORY_TEXTURE);
+    int x, y, level;
+    for (y = 0; y < size; y++) {
+        for (x = 0; x < size; x++) {
+            linear[y*size + x] = pixels[(y*height/size)*width + x*width/size];
+        }
+    }
+    texture->num_levels = 0;
+    for (level = 0; size >= 1 && level < MAX_MIP_LEVELS; level++) {
+        Uint32* swizzled = engine_malloc(sizeof(Uint32)*size*size, MEMORY_TEXTURE);
+        for (y = 0; y < size; y++) {
+            for (x = 0; x < size; x++) {
+                swizzled[morton_index(x, y)] = linear[y*size + x];
+            }
+        }
+        texture->levels[level] = swizzled;
+        texture->sizes[level] = size;
+        texture->num_levels += 1;
+        if (size == 1) { break; }
+        downsample_level(linear, size, linear); //In place is safe, each output texel is written after its inputs are read
+        size /= 2;
+    }
+    engine_free(linear);
+    return texture;
+}
+
+//Any format SDL can read as a BMP
+Texture* load_texture(char* path) {
+    SDL_Surface* loaded = SDL_LoadBMP(path);
+    if (loaded == NULL) {
+        printf("Could not load texture %s: %s\n", path, SDL_GetError());
+        return NULL;
+    }
+    SDL_Surface* surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(loaded);
+    if (surface == NULL) { return NULL; }
+    Uint32* pixels = engine_malloc(sizeof(Uint32)*surface->w*surface->h, MEMORY_TEXTURE);
+    int y;
+    SDL_LockSurface(surface);
+    for (y = 0; y < surface->h; y++) {
+        memcpy(pixels + y*surface->w, (Uint8*)surface->pixels + y*surface->pitch, sizeof(Uint32)*surface->w);
+    }
+    SDL_UnlockSurface(surface);
+    Texture* texture = create_texture(pixels, surface->w, surface->h);
+    engine_free(pixels);
+    SDL_FreeSurface(surface);
+    return texture;
+}
+
+Texture* create_checker_texture(int size, int squares, SDL_Color* a, SDL_Color* b) {
+    Uint32* pixels = engine_malloc(sizeof(Uint32)*size*size, MEMORY_TEXTURE);
+    int x, y;
+    int cell = size/squares > 0 ? size/squares : 1;
+    for (y = 0; y < size; y++) {
+        for (x = 0; x < size; x++) {
+            pixels[y*size + x] = map_color(((x/cell + y/cell) & 1) ? *a : *b);
+        }
+    }
+    Texture* texture = create_texture(pixels, size, size);
+    engine_free(pixels);
+    return texture;
+}
+
+void free_texture(Texture* texture) {
+    int i;
+    for (i = 0; i < texture->num_levels; i++) {
+        engine_free(texture->levels[i]);
+    }
+    engine_free(texture);
+}
+
+//Horizontal run of pixels from x1 to x2 inclusive, clipped to the framebuffer
+void draw_span(Framebuffer* fb, int x1, int x2, int y, Uint32 color) {
+    if (y < 0 || y >= fb->height) { return; }
+    if (x1 > x2) { int tmp = x1; x1 = x2; x2 = tmp; }
+    if (x1 < 0) { x1 = 0; }
+    if (x2 >= fb->width) { x2 = fb->width - 1; }
+    Uint32* row = fb->pixels + y*fb->width;
+    int x;
+    for (x = x1; x <= x2; x++) {
+        row[x] = color;
+    }
+}
+
+#define CLIP_LEFT 1
+#define CLIP_RIGHT 2
+#define CLIP_BOTTOM 4
+#define CLIP_TOP 8
+
+int clip_code(Framebuffer* fb, int x, int y) {
+    int code = 0;
+    if (x < 0) { code |= CLIP_LEFT; }
+    else if (x >= fb->width) { code |= CLIP_RIGHT; }
+    if (y < 0) { code |= CLIP_TOP; }
+    else if (y >= fb->height) { code |= CLIP_BOTTOM; }
+    return code;
+}
+
+//Cohen-Sutherland against the framebuffer bounds. Returns 0 if nothing is left to draw.
+int clip_line(Framebuffer* fb, int* x0, int* y0, int* x1, int* y1) {
+    int code0 = clip_code(fb, *x0, *y0);
+    int code1 = clip_code(fb, *x1, *y1);
+    double xmax = fb->width - 1;
+    double ymax = fb->height - 1;
+    while (1) {
+        if (!(code0 | code1)) { return 1; }
+        if (code0 & code1) { return 0; }
+        int code = code0 ? code0 : code1;
+        double dx = *x1 - *x0;
+        double dy = *y1 - *y0;
+        double x, y;
+        if (code & CLIP_BOTTOM) {
+            x = *x0 + dx*(ymax - *y0)/dy; y = ymax;
+        } else if (code & CLIP_TOP) {
+            x = *x0 + dx*(0 - *y0)/dy; y = 0;
+        } else if (code & CLIP_RIGHT) {
+            y = *y0 + dy*(xmax - *x0)/dx; x = xmax;
+        } else {
+            y = *y0 + dy*(0 - *x0)/dx; x = 0;
+        }
+        if (code == code0) {
+            *x0 = (int)x; *y0 = (int)y;
+            code0 = clip_code(fb, *x0, *y0);
+        } else {
+            *x1 = (int)x; *y1 = (int)y;
+            code1 = clip_code(fb, *x1, *y1);
+        }
+    }
+}
+
+//Clipped Bresenham, writes straight into the framebuffer. Inverse depth is linear in screen space,
+//so it steps once per pixel along the major axis. Pixels behind the depth buffer are skipped, nothing is written to it.
+void draw_line(Framebuffer* fb, int x0, int y0, float z0, int x1, int y1, float z1, Uint32 color) {
+    int ox0 = x0, oy0 = y0;
+    int span = abs(x1 - x0) >= abs(y1 - y0) ? x1 - x0 : y1 - y0;
+    float dz = z1 - z0;
+    if (!clip_line(fb, &x0, &y0, &x1, &y1)) { return; }
+    int dx = abs(x1 - x0);
+    int dy = -abs(y1 - y0);
+    int sx = x0 < x1 ? 1 : -1;
+    int sy = y0 < y1 ? fb->width : -fb->width;
+    int ystep = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    int e2;
+    int steps = dx > -dy ? dx : -dy;
+    float z = z0, zstep = 0;
+    if (span != 0) {
+        //Clipping moved the endpoints, find where they sit on the unclipped line
+        int major = abs(x1 - x0) >= abs(y1 - y0);
+        float t0 = (float)(major ? x0 - ox0 : y0 - oy0)/span;
+        float t1 = (float)(major ? x1 - ox0 : y1 - oy0)/span;
+        z = z0 + dz*t0;
+        if (steps > 0) { zstep = dz*(t1 - t0)/steps; }
+    }
+    int i = y0*fb->width + x0;
+    while (1) {
+        if (z*(1 + EDGE_BIAS) >= fb->depth[i]) { fb->pixels[i] = color; }
+        if (x0 == x1 && y0 == y1) { break; }
+        e2 = 2*err;
+        if (e2 >= dy) { err += dy; x0 += sx; i += sx; }
+        if (e2 <= dx) { err += dx; y0 += ystep; i += sy; }
+        z += zstep;
+    }
+}
+
+//Rz * Ry * Rx, shared by the mesh and camera rotations
+void rotation_matrix(Vector3 axes, double transform[][3]) {
+    //Product written out, it runs for every dirty scene graph node
+    double cx = cos(axes.x), sx = sin(axes.x);
+    double cy = cos(axes.y), sy = sin(axes.y);
+    double cz = cos(axes.z), sz = sin(axes.z);
+    transform[0][0] = cz*cy; transform[0][1] = cz*sy*sx - sz*cx; transform[0][2] = cz*sy*cx + sz*sx;
+    transform[1][0] = sz*cy; transform[1][1] = sz*sy*sx + cz*cx; transform[1][2] = sz*sy*cx - cz*sx;
+    transform[2][0] = -sy;   transform[2][1] = cy*sx;            transform[2][2] = cy*cx;
+}
+
+//Add a node under parent (-1 for a root). Returns its index, which is also its place in the update order.
+int add_transform_node(SceneGraph* graph, int parent) {
+    if (parent >= graph->nodes_added) { return -1; } //Parents must exist first, that keeps the array sorted
+    if (graph->nodes_added == graph->num_nodes) {
+        graph->num_nodes *= 2;
+        graph->nodes = engine_realloc(graph->nodes, sizeof(TransformNode)*graph->num_nodes, MEMORY_GEOMETRY);
+    }
+    int index = graph->nodes_added;
+    TransformNode* node = &(graph->nodes[index]);
+    node->parent = parent;
+    node->translation.x = 0; node->translation.y = 0; node->translation.z = 0;
+    node->rotation = node->translation;
+    node->pivot = node->translation;
+    node->version = 0;
+    node->dirty = 1;
+    node->updated = 0;
+    graph->nodes_added += 1;
+    if (index < graph->first_dirty) { graph->first_dirty = index; }
+    return index;
+}
+
+void mark_node_dirty(SceneGraph* graph, int index) {
+    graph->nodes[index].dirty = 1;
+    if (index < graph->first_dirty) { graph->first_dirty = index; }
+}
+
+void set_node_rotation(SceneGraph* graph, int index, Vector3 rotation) {
+    graph->nodes[index].rotation = rotation;
+    mark_node_dirty(graph, index);
+}
+
+void set_node_translation(SceneGraph* graph, int index, Vector3 translation) {
+    graph->nodes[index].translation = translation;
+    mark_node_dirty(graph, index);
+}
+
+//Resolve world transforms in one forward pass. Everything before first_dirty is untouched, and past it a node
+//is only recomputed if it was edited or its parent changed this pass, so clean subtrees cost one compare per node.
+void update_scene_graph(SceneGraph* graph) {
+    int i, j, k;
+    int start = graph->first_dirty;
+    TransformNode* node;
+    TransformNode* parent;
+    Vector3 offset;
+    for (i = start; i < graph->nodes_added; i++) {
+        node = &(graph->nodes[i]);
+        //Parents below start were not touched this pass, whatever their updated flag says
+        node->updated = node->dirty || (node->parent >= start && graph->nodes[node->parent].updated);
+        if (!node->updated) { continue; }
+        if (node->dirty) {
+            rotation_matrix(node->rotation, node->local);
+            //Rotate about pivot then translate: local*(p - pivot) + pivot + translation
+            offset = matrix_x_vector(node->local, node->pivot);
+            node->local_offset.x = node->pivot.x + node->translation.x - offset.x;
+            node->local_offset.y = node->pivot.y + node->translation.y - offset.y;
+            node->local_offset.z = node->pivot.z + node->translation.z - offset.z;
+        }
+        offset = node->local_offset;
+        if (node->parent < 0) {
+            memcpy(node->world, node->local, sizeof(node->local));
+            node->world_translation = offset;
+        } else {
+            parent = &(graph->nodes[node->parent]);
+            for (j = 0; j < 3; j++) {
+                for (k = 0; k < 3; k++) {
+                    node->world[j][k] = parent->world[j][0]*node->local[0][k] + parent->world[j][1]*node->local[1][k] + parent->world[j][2]*node->local[2][k];
+                }
+            }
+            node->world_translation = matrix_x_vector(parent->world, offset);
+            node->world_translation.x += parent->world_translation.x;
+            node->world_translation.y += parent->world_translation.y;
+            node->world_translation.z += parent->world_translation.z;
+        }
+        node->version += 1;
+        node->dirty = 0;
+    }
+    graph->first_dirty = graph->nodes_added;
+}
+
+void attach_mesh(Mesh* mesh, int node) {
+    mesh->node = node;
+    mesh->transform_valid = 0;
+    mesh->cached_valid = 0;
+}
+
+//Full affine for a mesh: local_transform = m*(position - center) + t
+void mesh_transform(Mesh* mesh, SceneGraph* graph, double m[][3], Vector3* t) {
+    double rot[3][3];
+    rotation_matrix(mesh->rotation, rot);
+    if (mesh->node < 0) {
+        memcpy(m, rot, sizeof(rot));
+        *t = mesh->center;
+        return;
+    }
+    TransformNode* node = &(graph->nodes[mesh->node]);
+    int j, k;
+    for (j = 0; j < 3; j++) {
+        for (k = 0; k < 3; k++) {
+            m[j][k] = node->world[j][0]*rot[0][k] + node->world[j][1]*rot[1][k] + node->world[j][2]*rot[2][k];
+        }
+    }
+    *t = matrix_x_vector(node->world, mesh->center);
+    t->x += node->world_translation.x;
+    t->y += node->world_translation.y;
+    t->z += node->world_translation.z;
+}
+
+//mesh_transform, only recomputed when the rotation or node moved. Culling, rotate_mesh and cast_ray
+//all want it every frame, and cast_ray wants it while holding world->lock.
+void cached_mesh_transform(Mesh* mesh, SceneGraph* graph, double m[][3], Vector3* t) {
+    int node_version = mesh->node < 0 ? 0 : graph->nodes[mesh->node].version;
+    if (!mesh->cached_valid || mesh->cached_rotation.x != mesh->rotation.x || mesh->cached_rotation.y != mesh->rotation.y ||
+        mesh->cached_rotation.z != mesh->rotation.z || mesh->cached_node_version != node_version) {
+        mesh_transform(mesh, graph, mesh->cached_transform, &(mesh->cached_offset));
+        Vector3 half, middle;
+        half.x = (mesh->bounds_max.x - mesh->bounds_min.x)/2;
+        half.y = (mesh->bounds_max.y - mesh->bounds_min.y)/2;
+        half.z = (mesh->bounds_max.z - mesh->bounds_min.z)/2;
+        middle.x = mesh->bounds_min.x + half.x - mesh->center.x;
+        middle.y = mesh->bounds_min.y + half.y - mesh->center.y;
+        middle.z = mesh->bounds_min.z + half.z - mesh->center.z;
+        mesh->cached_sphere_center = matrix_x_vector(mesh->cached_transform, middle);
+        mesh->cached_sphere_center.x += mesh->cached_offset.x;
+        mesh->cached_sphere_center.y += mesh->cached_offset.y;
+        mesh->cached_sphere_center.z += mesh->cached_offset.z;
+        mesh->cached_sphere_radius = sqrt(half.x*half.x + half.y*half.y + half.z*half.z);
+        mesh->cached_rotation = mesh->rotation;
+        mesh->cached_node_version = node_version;
+        mesh->cached_valid = 1;
+    }
+    memcpy(m, mesh->cached_transform, sizeof(mesh->cached_transform));
+    *t = mesh->cached_offset;
+}
+
+//Octahedral normal encoding: project onto the |x|+|y|+|z| = 1 octahedron, fold the lower half over, store x, y
+void encode_octahedral(Vector3 n, Uint8 out[2]) {
+    double sum = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if (sum == 0) { out[0] = 128; out[1] = 128; return; }
+    double x = n.x/sum, y = n.y/sum;
+    if (n.z < 0) {
+        double fx = (1 - fabs(y))*(x >= 0 ? 1 : -1);
+        double fy = (1 - fabs(x))*(y >= 0 ? 1 : -1);
+        x = fx; y = fy;
+    }
+    out[0] = (Uint8)floor((x*0.5 + 0.5)*255 + 0.5);
+    out[1] = (Uint8)floor((y*0.5 + 0.5)*255 + 0.5);
+}
+
+void decode_octahedral(const Uint8 in[2], float* x, float* y, float* z) {
+    float nx = in[0]*(2.0f/255) - 1;
+    float ny = in[1]*(2.0f/255) - 1;
+    float nz = 1 - fabsf(nx) - fabsf(ny);
+    float t = nz < 0 ? -nz : 0;
+    nx += nx >= 0 ? -t : t;
+    ny += ny >= 0 ? -t : t;
+    float len = sqrtf(nx*nx + ny*ny + nz*nz);
+    *x = nx/len; *y = ny/len; *z = nz/len;
+}
+
+//Source position of a pool vertex, whichever form the mesh stores it in
+Vector3 mesh_position(Mesh* mesh, int index) {
+    if (mesh->packed == NULL) {
+        return mesh->positions[index];
+    }
+    Vector3 p;
+    p.x = mesh->bounds_min.x + mesh->packed[index].x*mesh->quant_scale.x;
+    p.y = mesh->bounds_min.y + mesh->packed[index].y*mesh->quant_scale.y;
+    p.z = mesh->bounds_min.z + mesh->packed[index].z*mesh->quant_scale.z;
+    return p;
+}
+
+//Transform kernel for packed meshes. Dequantization is folded into the matrix and offset,
+//so decoding a position costs nothing beyond the transform itself.
+void rotate_packed_vertices(Mesh* mesh, double transform[][3], Vector3 offset) {
+    double m[3][3];
+    int i;
+    for (i = 0; i < 3; i++) {
+        m[i][0] = transform[i][0]*mesh->quant_scale.x;
+        m[i][1] = transform[i][1]*mesh->quant_scale.y;
+        m[i][2] = transform[i][2]*mesh->quant_scale.z;
+    }
+    Vector3 base;
+    base.x = mesh->bounds_min.x - mesh->center.x;
+    base.y = mesh->bounds_min.y - mesh->center.y;
+    base.z = mesh->bounds_min.z - mesh->center.z;
+    base = matrix_x_vector(transform, base);
+    base.x += offset.x; base.y += offset.y; base.z += offset.z;
+    PackedVertex* p;
+    Vertex* vert;
+    for (i = 0; i < mesh->vertices_added; i++) {
+        p = &(mesh->packed[i]);
+        vert = &(mesh->vertices[i]);
+        vert->local_transform.x = m[0][0]*p->x + m[0][1]*p->y + m[0][2]*p->z + base.x;
+        vert->local_transform.y = m[1][0]*p->x + m[1][1]*p->y + m[1][2]*p->z + base.y;
+        vert->local_transform.z = m[2][0]*p->x + m[2][1]*p->y + m[2][2]*p->z + base.z;
+    }
+}
+
 //rotate a mesh locally
-void rotate_mesh(Mesh* mesh) { //Affects local_transform
-    Vector3* rotation = &(mesh->rotation);
+void rotate_mesh(Mesh* mesh, SceneGraph* graph) { //Affects local_transform
+    mesh->re_render = 1;
+    int node_version = mesh->node < 0 ? 0 : graph->nodes[mesh->node].version;
+    if (mesh->transform_valid && mesh->applied_rotation.x == mesh->rotation.x &&
+        mesh->applied_rotation.y == mesh->rotation.y && mesh->applied_rotation.z == mesh->rotation.z &&
+        mesh->applied_node_version == node_version) {
+        return; //Static meshes keep last frame's local_transform, and with it their lighting
+    }
     Vector3 center = mesh->center;
-    double rx[3][3] = {
-        {1, 0, 0},
-        {0, cos(rotation->x), -1*sin(rotation->x)},
-        {0, sin(rotation->x), cos(rotation->x)}
-    };
-    double ry[3][3] = {
-        {cos(rotation->y), 0, sin(rotation->y)},
-        {0, 1, 0},
-        {-1*sin(rotation->y), 0, cos(rotation->y)}
-    };
-    double rz[3][3] = {
-        {cos(rotation->z), -1*sin(rotation->z), 0},
-        {sin(rotation->z), cos(rotation->z), 0},
-        {0, 0, 1}
-    };
-    double res1[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
-    matrix_x_matrix(ry, rx, res1);
-    double transform[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
-    matrix_x_matrix(rz, res1, transform);
+    Vector3 offset;
+    double transform[3][3];
+    cached_mesh_transform(mesh, graph, transform, &offset);
 
     Vertex* vert;
     Vector3 vect;
+    int i;
+    if (mesh->packed != NULL) {
+        rotate_packed_vertices(mesh, transform, offset);
+    } else {
+        for (i = 0; i < mesh->vertices_added; i++) {
+            vert = &(mesh->vertices[i]);
+            vect.x = mesh->positions[i].x - center.x,
+            vect.y = mesh->positions[i].y - center.y,
+            vect.z = mesh->positions[i].z - center.z,
+            vect = matrix_x_vector(transform, vect);
+            vert->local_transform.x = vect.x + offset.x;
+            vert->local_transform.y = vect.y + offset.y;
+            vert->local_transform.z = vect.z + offset.z;
+        }
+    }
+    mesh->transformed_center = offset;
+    mesh->applied_rotation = mesh->rotation;
+    mesh->applied_node_version = node_version;
+    mesh->transform_valid = 1;
+    mesh->lit_version = -1;
+}
+
+DepthPyramid* create_depth_pyramid(int width, int height) {
+    DepthPyramid* pyramid = engine_malloc(sizeof(DepthPyramid), MEMORY_FRAME);
+    int w = width;
+    int h = height;
+    int level = 0;
+    while ((w > 1 || h > 1) && level < MAX_PYRAMID_LEVELS) {
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+        pyramid->levels[level] = engine_malloc(sizeof(float)*w*h, MEMORY_FRAME);
+        pyramid->widths[level] = w;
+        pyramid->heights[level] = h;
+        level++;
+    }
+    pyramid->num_levels = level;
+    pyramid->valid = 0;
+    return pyramid;
+}
+
+void free_depth_pyramid(DepthPyramid* pyramid) {
+    int i;
+    for (i = 0; i < pyramid->num_levels; i++) {
+        engine_free(pyramid->levels[i]);
+    }
+    engine_free(pyramid);
+}
+
+//Each texel takes the farthest of its (up to) 2x2 children. Odd edges clamp, which only makes the result more conservative.
+void reduce_depth(float* src, int src_w, int src_h, float* dst, int dst_w, int dst_h) {
+    int x, y, x1, y1;
+    float a, b, c, d;
+    for (y = 0; y < dst_h; y++) {
+        y1 = 2*y + 1 < src_h ? 2*y + 1 : src_h - 1;
+        for (x = 0; x < dst_w; x++) {
+            x1 = 2*x + 1 < src_w ? 2*x + 1 : src_w - 1;
+            a = src[2*y*src_w + 2*x];
+            b = src[2*y*src_w + x1];
+            c = src[y1*src_w + 2*x];
+            d = src[y1*src_w + x1];
+            a = a < b ? a : b;
+            c = c < d ? c : d;
+            dst[y*dst_w + x] = a < c ? a : c;
+        }
+    }
+}
+
+void build_depth_pyramid(DepthPyramid* pyramid, Framebuffer* fb) {
+    int i;
+    reduce_depth(fb->depth, fb->width, fb->height, pyramid->levels[0], pyramid->widths[0], pyramid->heights[0]);
+    for (i = 1; i < pyramid->num_levels; i++) {
+        reduce_depth(pyramid->levels[i-1], pyramid->widths[i-1], pyramid->heights[i-1],
+                     pyramid->levels[i], pyramid->widths[i], pyramid->heights[i]);
+    }
+    pyramid->valid = 1;
+}
+
+//Test a mesh's bounding box against the pyramid before any of its vertices are touched.
+//The 8 box corners go through the same mesh rotation, camera rotation and projection as the vertices.
+//Returns 1 only if the box is provably behind what was drawn or entirely off screen. box_nearest gets
+//the box's largest inverse depth, 1/near_plane if it crosses the near plane.
+int box_occluded(DepthPyramid* pyramid, Mesh* mesh, SceneGraph* graph, double camera[][3], Vector3 origin, double* box_nearest) {
+    double rot[3][3];
+    Vector3 offset;
+    cached_mesh_transform(mesh, graph, rot, &offset);
+    int i;
+    double xMin = DBL_MAX, yMin = DBL_MAX, xMax = -DBL_MAX, yMax = -DBL_MAX;
+    double nearest = 0; //Largest inverse depth of any corner
+    Vector3 corner, local, view;
+    double depth, sx, sy;
+    for (i = 0; i < 8; i++) {
+        corner.x = (i & 1 ? mesh->bounds_max.x : mesh->bounds_min.x) - mesh->center.x;
+        corner.y = (i & 2 ? mesh->bounds_max.y : mesh->bounds_min.y) - mesh->center.y;
+        corner.z = (i & 4 ? mesh->bounds_max.z : mesh->bounds_min.z) - mesh->center.z;
+        local = matrix_x_vector(rot, corner);
+        local.x += offset.x - origin.x;
+        local.y += offset.y - origin.y;
+        local.z += offset.z - origin.z;
+        view = matrix_x_vector(camera, local);
+        view.x += origin.x;
+        view.y += origin.y;
+        view.z += origin.z;
+        //The camera rotates about the subject, which is also the translation render_world projects with
+        depth = view.z + origin.z;
+        if (depth <= near_plane) { //Crosses the near plane, let the rasterizer deal with it
+            *box_nearest = 1/near_plane;
+            return 0;
+        }
+        sx = padding_left + (view.x - origin.x)*(focal_length/depth);
+        sy = HEIGHT - (padding_bottom + (view.y + origin.y)*(focal_length/depth));
+        if (sx < xMin) { xMin = sx; }
+        if (sx > xMax) { xMax = sx; }
+        if (sy < yMin) { yMin = sy; }
+        if (sy > yMax) { yMax = sy; }
+        if (1/depth > nearest) { nearest = 1/depth; }
+    }
+    *box_nearest = nearest;
+    if (xMax < 0 || yMax < 0 || xMin >= WIDTH || yMin >= HEIGHT) { return 1; }
+    if (pyramid == NULL || !pyramid->valid) { return 0; }
+    //The pyramid is last frame's depth, which includes this mesh. Anything up to the depth the mesh drew
+    //itself could be its own pixels, so only nearer texels count as occluders. Otherwise a wall facing
+    //the camera culls itself every other frame, or every frame while the camera backs away from it.
+    if (mesh->drawn_nearest > nearest) { nearest = mesh->drawn_nearest; }
+    nearest *= 1 + OCCLUSION_BIAS; //The pyramid is float, the box double
+    if (xMin < 0) { xMin = 0; }
+    if (yMin < 0) { yMin = 0; }
+    if (xMax > WIDTH - 1) { xMax = WIDTH - 1; }
+    if (yMax > HEIGHT - 1) { yMax = HEIGHT - 1; }
+
+    //Pick the level where the box covers about 2x2 texels, so the test is a handful of reads
+    double extent = xMax - xMin > yMax - yMin ? xMax - xMin : yMax - yMin;
+    int level = 0;
+    while (level < pyramid->num_levels - 1 && extent > (2 << level)) {
+        level++;
+    }
+    int shift = level + 1; //Level 0 is already half resolution
+    int x0 = (int)xMin >> shift, x1 = (int)xMax >> shift;
+    int y0 = (int)yMin >> shift, y1 = (int)yMax >> shift;
+    int x, y;
+    float* texels = pyramid->levels[level];
+    int w = pyramid->widths[level];
+    for (y = y0; y <= y1; y++) {
+        for (x = x0; x <= x1; x++) {
+            if (texels[y*w + x] <= nearest) { return 0; }
+        }
+    }
+    return 1;
+}
+
+//Hierarchical Z test against last frame's depth. Remembers how near the mesh draws for the next frame's test.
+int mesh_occluded(DepthPyramid* pyramid, Mesh* mesh, SceneGraph* graph, double camera[][3], Vector3 origin) {
+    double nearest = 0;
+    int occluded = box_occluded(pyramid, mesh, graph, camera, origin, &nearest);
+    mesh->drawn_nearest = occluded ? 0 : nearest;
+    return occluded;
+}
+
+//Lights are in the same space as local_transform, so moving the camera never invalidates lighting
+void add_light(World* world, int type, double x, double y, double z, double intensity) {
+    if (world->num_lights >= MAX_LIGHTS) { return; }
+    Light* light = &(world->lights[world->num_lights]);
+    light->type = type;
+    light->vector.x = x; light->vector.y = y; light->vector.z = z;
+    light->intensity = intensity;
+    world->num_lights += 1;
+    if (world->num_lights == 1) {
+        world->ambient = 0.2;
+    }
+    world->lights_version += 1;
+}
+
+//Lighting term for n normals/positions in SoA layout, four at a time with SSE2
+void shade_batch(World* world, int n, float* nx, float* ny, float* nz, float* px, float* py, float* pz, float* out) {
+    float dir[MAX_LIGHTS][3]; //Normalized vector towards directional lights
+    int l, i = 0;
+    for (l = 0; l < world->num_lights; l++) {
+        Vector3 v = world->lights[l].vector;
+        double len = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+        if (len == 0) { len = 1; }
+        dir[l][0] = -v.x/len; dir[l][1] = -v.y/len; dir[l][2] = -v.z/len;
+    }
+#ifdef __SSE2__
+    __m128 zero = _mm_setzero_ps();
+    __m128 epsilon = _mm_set1_ps(1e-6f);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(nx + i);
+        __m128 y = _mm_loadu_ps(ny + i);
+        __m128 z = _mm_loadu_ps(nz + i);
+        __m128 sum = _mm_set1_ps(world->ambient);
+        for (l = 0; l < world->num_lights; l++) {
+            Light* light = &(world->lights[l]);
+            __m128 lx, ly, lz;
+            if (light->type == LIGHT_POINT) {
+                lx = _mm_sub_ps(_mm_set1_ps(light->vector.x), _mm_loadu_ps(px + i));
+                ly = _mm_sub_ps(_mm_set1_ps(light->vector.y), _mm_loadu_ps(py + i));
+                lz = _mm_sub_ps(_mm_set1_ps(light->vector.z), _mm_loadu_ps(pz + i));
+                __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz)));
+                len = _mm_max_ps(len, epsilon);
+                lx = _mm_div_ps(lx, len);
+                ly = _mm_div_ps(ly, len);
+                lz = _mm_div_ps(lz, len);
+            } else {
+                lx = _mm_set1_ps(dir[l][0]);
+                ly = _mm_set1_ps(dir[l][1]);
+                lz = _mm_set1_ps(dir[l][2]);
+            }
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, lx), _mm_mul_ps(y, ly)), _mm_mul_ps(z, lz));
+            d = _mm_max_ps(d, zero);
+            sum = _mm_add_ps(sum, _mm_mul_ps(d, _mm_set1_ps(light->intensity)));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+#endif
+    for (; i < n; i++) {
+        float sum = world->ambient;
+        for (l = 0; l < world->num_lights; l++) {
+            Light* light = &(world->lights[l]);
+            float lx, ly, lz;
+            if (light->type == LIGHT_POINT) {
+                lx = light->vector.x - px[i];
+                ly = light->vector.y - py[i];
+                lz = light->vector.z - pz[i];
+                float len = sqrtf(lx*lx + ly*ly + lz*lz);
+                if (len < 1e-6f) { len = 1e-6f; }
+                lx /= len; ly /= len; lz /= len;
+            } else {
+                lx = dir[l][0]; ly = dir[l][1]; lz = dir[l][2];
+            }
+            float d = nx[i]*lx + ny[i]*ly + nz[i]*lz;
+            if (d > 0) { sum += d*light->intensity; }
+        }
+        out[i] = sum;
+    }
+}
+
+void normalize_soa(int n, float* x, float* y, float* z) {
+    int i;
+    float len;
+    for (i = 0; i < n; i++) {
+        len = sqrtf(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+        if (len > 0) { x[i] /= len; y[i] /= len; z[i] /= len; }
+    }
+}
+
+//Newell's method, works for any planar polygon. The normal is area scaled, not normalized.
+//Corners are read from SoA pool coordinates px, py, pz, the same arrays light_mesh shades with.
+//Polygons aren't wound consistently (see create_cube_mesh), so the normal is pointed away from center.
+void polygon_normal(Polygon* poly, float* px, float* py, float* pz, Vector3 center, Vector3* normal, Vector3* centroid) {
+    double x = 0, y = 0, z = 0, mx = 0, my = 0, mz = 0;
+    int k, a, b;
+    for (k = 0; k < poly->vertices_added; k++) {
+        a = poly->indices[k];
+        b = poly->indices[(k + 1) % poly->vertices_added];
+        x += ((double)py[a] - py[b])*((double)pz[a] + pz[b]);
+        y += ((double)pz[a] - pz[b])*((double)px[a] + px[b]);
+        z += ((double)px[a] - px[b])*((double)py[a] + py[b]);
+        mx += px[a]; my += py[a]; mz += pz[a];
+    }
+    if (poly->vertices_added > 0) {
+        mx /= poly->vertices_added; my /= poly->vertices_added; mz /= poly->vertices_added;
+    }
+    if (x*(mx - center.x) + y*(my - center.y) + z*(mz - center.z) < 0) {
+        x = -x; y = -y; z = -z;
+    }
+    normal->x = x; normal->y = y; normal->z = z;
+    centroid->x = mx; centroid->y = my; centroid->z = mz;
+}
+
+//Recompute face and vertex lighting from local_transform. Only runs when rotate_mesh or the lights invalidate it.
+void light_mesh(World* world, Mesh* mesh) {
+    int nf = mesh->polygons_added;
+    int nv = mesh->vertices_added;
+    if (6*(nf + nv) > world->light_scratch_size) {
+        world->light_scratch_size = 6*(nf + nv);
+        engine_free(world->light_scratch); //Old contents aren't needed, skip realloc's copy
+        world->light_scratch = engine_malloc(sizeof(float)*world->light_scratch_size, MEMORY_FRAME);
+    }
+    float* fx = world->light_scratch;        float* fy = fx + nf;  float* fz = fy + nf;
+    float* cx = fz + nf;    float* cy = cx + nf;  float* cz = cy + nf;
+    float* vx = cz + nf;    float* vy = vx + nv;  float* vz = vy + nv;
+    float* qx = vz + nv;    float* qy = qx + nv;  float* qz = qy + nv;
     int i, k;
-    for (i = 0; i < mesh->num_polygons; i++) {
-        for (k = 0; k < mesh->polygons[i]->num_vertices; k++) {
-            vert = &(mesh->polygons[i]->sequence[k]);
-            vect.x = vert->absolute_position.x - center.x,
-            vect.y = vert->absolute_position.y - center.y,
-            vect.z = vert->absolute_position.z - center.z,
-            vert->local_transform = matrix_x_vector(transform, vect);
-            vert->local_transform.x += center.x;
-            vert->local_transform.y += center.y;
-            vert->local_transform.z += center.z;
+    for (i = 0; i < nv; i++) {
+        vx[i] = 0; vy[i] = 0; vz[i] = 0;
+        qx[i] = mesh->vertices[i].local_transform.x;
+        qy[i] = mesh->vertices[i].local_transform.y;
+        qz[i] = mesh->vertices[i].local_transform.z;
+    }
+    Polygon* poly;
+    Vector3 normal, centroid;
+    for (i = 0; i < nf; i++) {
+        poly = mesh->polygons[i];
+        polygon_normal(poly, qx, qy, qz, mesh->transformed_center, &normal, &centroid);
+        fx[i] = normal.x; fy[i] = normal.y; fz[i] = normal.z;
+        cx[i] = centroid.x; cy[i] = centroid.y; cz[i] = centroid.z;
+        if (mesh->packed != NULL) { continue; }
+        for (k = 0; k < poly->vertices_added; k++) { //Area weighted, Newell normals are not normalized yet
+            vx[poly->indices[k]] += normal.x;
+            vy[poly->indices[k]] += normal.y;
+            vz[poly->indices[k]] += normal.z;
         }
     }
-    mesh->re_render = 1;
+    normalize_soa(nf, fx, fy, fz);
+    if (mesh->packed != NULL) { //Packed meshes carry their own, decoded here and rotated the way rotate_mesh rotated the positions
+        double transform[3][3];
+        Vector3 offset;
+        float nx, ny, nz;
+        cached_mesh_transform(mesh, &(world->graph), transform, &offset);
+        for (i = 0; i < nv; i++) {
+            decode_octahedral(mesh->packed[i].normal, &nx, &ny, &nz);
+            vx[i] = transform[0][0]*nx + transform[0][1]*ny + transform[0][2]*nz;
+            vy[i] = transform[1][0]*nx + transform[1][1]*ny + transform[1][2]*nz;
+            vz[i] = transform[2][0]*nx + transform[2][1]*ny + transform[2][2]*nz;
+        }
+    } else {
+        normalize_soa(nv, vx, vy, vz);
+    }
+    shade_batch(world, nf, fx, fy, fz, cx, cy, cz, mesh->face_light);
+    shade_batch(world, nv, vx, vy, vz, qx, qy, qz, mesh->vertex_light);
+    mesh->lit_version = world->lights_version;
 }
 
+//Transform every mesh that survives the occlusion test, the rest are skipped entirely this frame
 void rotate_all_in_world(World* world, Vector3 axes, Vector3 origin) { //affects perspective
-    double rx[3][3] = {
-        {1, 0, 0},
-        {0, cos(axes.x), -1*sin(axes.x)},
-        {0, sin(axes.x), cos(axes.x)}
-    };
-    double ry[3][3] = {
-        {cos(axes.y), 0, sin(axes.y)},
-        {0, 1, 0},
-        {-1*sin(axes.y), 0, cos(axes.y)}
-    };
-    double rz[3][3] = {
-        {cos(axes.z), -1*sin(axes.z), 0},
-        {sin(axes.z), cos(axes.z), 0},
-        {0, 0, 1}
-    };
-
-    double res1[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
-    matrix_x_matrix(ry, rx, res1);
-    double transform[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
-    matrix_x_matrix(rz, res1, transform);
+    double transform[3][3];
+    rotation_matrix(axes, transform);
 
-    int i, j, k;
+    int i, k;
     Vertex* vertex;
     Vector3 vect;
+    world->meshes_culled = 0;
+    update_scene_graph(&(world->graph));
     for (i = 0; i < world->meshes_added; i++) {
-        rotate_mesh(world->meshes[i]); //Updates local_transform
-        for (j = 0; j < world->meshes[i]->num_polygons; j++) {
-            for (k = 0; k < world->meshes[i]->polygons[j]->num_vertices; k++) {
-                vertex = &(world->meshes[i]->polygons[j]->sequence[k]);
-                vect.x = vertex->local_transform.x - origin.x,
-                vect.y = vertex->local_transform.y - origin.y,
-                vect.z = vertex->local_transform.z - origin.z,
-                vertex->perspective = matrix_x_vector(transform, vect);
-                vertex->perspective.x += origin.x;
-                vertex->perspective.y += origin.y;
-                vertex->perspective.z += origin.z;
-            }
+        world->meshes[i]->occluded = mesh_occluded(world->occlusion, world->meshes[i], &(world->graph), transform, origin);
+        if (world->meshes[i]->occluded) {
+            world->meshes_culled++;
+            continue;
+        }
+        rotate_mesh(world->meshes[i], &(world->graph)); //Updates local_transform
+        if (!world->wireframe && world->meshes[i]->lit_version != world->lights_version) {
+            light_mesh(world, world->meshes[i]);
+        }
+        for (k = 0; k < world->meshes[i]->vertices_added; k++) {
+            vertex = &(world->meshes[i]->vertices[k]);
+            vect.x = vertex->local_transform.x - origin.x,
+            vect.y = vertex->local_transform.y - origin.y,
+            vect.z = vertex->local_transform.z - origin.z,
+            vect = matrix_x_vector(transform, vect);
+            vertex->perspective.x = vect.x + origin.x;
+            vertex->perspective.y = vect.y + origin.y;
+            vertex->perspective.z = vect.z + origin.z;
         }
     }
 }
@@ -216,190 +1535,1734 @@ void push_vertex(Polygon* poly, double x, double y, double z) {
     //printf("Inserting at location %i\n", poly->vertices_added);
     //memcpy(poly->sequence + poly->vertices_added, v, sizeof(Vector3));
     Vector3 pos; pos.x = x; pos.y = y; pos.z = z;
-    Vertex vertex;
-    vertex.absolute_position = pos;
-    vertex.local_transform = pos;
-    vertex.perspective = pos;
-    poly->sequence[poly->vertices_added] = vertex;
+    poly->sequence[poly->vertices_added] = pos;
     //print_vec(poly->sequence[poly->vertices_added]);
+    poly->uvs[2*poly->vertices_added] = 0;
+    poly->uvs[2*poly->vertices_added + 1] = 0;
     poly->vertices_added += 1;
 }
 
-//Add Polygon to a mesh
+//Add a vertex with texture coordinates, 0..1 covers the texture once and anything else wraps
+void push_vertex_uv(Polygon* poly, double x, double y, double z, float u, float v) {
+    push_vertex(poly, x, y, z);
+    poly->uvs[2*(poly->vertices_added - 1)] = u;
+    poly->uvs[2*(poly->vertices_added - 1) + 1] = v;
+}
+
+//Add Polygon to a mesh. Its vertices move into the mesh pool, duplicates are welded by build_mesh.
+//Packed meshes are final, they can't take more polygons.
 void add_polygon(Mesh* mesh, Polygon* poly) {
+    int k;
+    if (mesh->vertices_added + poly->vertices_added > mesh->num_vertices) {
+        mesh->num_vertices = (mesh->vertices_added + poly->vertices_added)*2;
+        mesh->positions = engine_realloc(mesh->positions, sizeof(Vector3)*mesh->num_vertices, MEMORY_GEOMETRY);
+    }
+    for (k = 0; k < poly->vertices_added; k++) {
+        mesh->positions[mesh->vertices_added] = poly->sequence[k];
+        poly->indices[k] = mesh->vertices_added;
+        mesh->vertices_added += 1;
+    }
+    engine_free(poly->sequence);
+    poly->sequence = NULL;
     mesh->polygons[mesh->polygons_added] = poly;
     mesh->polygons_added += 1;
+    mesh->built = 0;
+}
+
+typedef struct WeldKey {
+    Vector3 position;
+    int index;
+} WeldKey;
+
+int compare_weld_keys(const void* p1, const void* p2) {
+    const Vector3* a = &((const WeldKey*)p1)->position;
+    const Vector3* b = &((const WeldKey*)p2)->position;
+    if (a->x != b->x) { return a->x < b->x ? -1 : 1; }
+    if (a->y != b->y) { return a->y < b->y ? -1 : 1; }
+    if (a->z != b->z) { return a->z < b->z ? -1 : 1; }
+    return 0;
+}
+
+int compare_edges(const void* p1, const void* p2) {
+    const Edge* a = p1;
+    const Edge* b = p2;
+    if (a->a != b->a) { return a->a - b->a; }
+    return a->b - b->b;
+}
+
+//Weld shared vertices and build the unique edge list. Sorting keeps this n log n for big meshes.
+void build_mesh(Mesh* mesh) {
+    int n = mesh->vertices_added;
+    int i, j, k;
+    WeldKey* keys = engine_malloc(sizeof(WeldKey)*n + 1, MEMORY_GEOMETRY);
+    int* remap = engine_malloc(sizeof(int)*n + 1, MEMORY_GEOMETRY);
+    for (i = 0; i < n; i++) {
+        keys[i].position = mesh->positions[i];
+        keys[i].index = i;
+    }
+    qsort(keys, n, sizeof(WeldKey), compare_weld_keys);
+    int unique = 0;
+    for (i = 0; i < n; i++) {
+        if (i == 0 || compare_weld_keys(keys + i - 1, keys + i) != 0) { unique++; }
+    }
+    Vector3* welded = engine_malloc(sizeof(Vector3)*unique + 1, MEMORY_GEOMETRY);
+    unique = 0;
+    for (i = 0; i < n; i++) {
+        if (i == 0 || compare_weld_keys(keys + i - 1, keys + i) != 0) {
+            welded[unique] = mesh->positions[keys[i].index];
+            unique++;
+        }
+        remap[keys[i].index] = unique - 1;
+    }
+    free_mesh_data(mesh, mesh->positions);
+    mesh->positions = welded;
+    mesh->vertices_added = unique;
+    mesh->num_vertices = unique;
+    free_mesh_data(mesh, mesh->vertices);
+    mesh->vertices = engine_malloc(sizeof(Vertex)*unique + 1, MEMORY_FRAME);
+    for (i = 0; i < unique; i++) {
+        mesh->vertices[i].local_transform.x = welded[i].x;
+        mesh->vertices[i].local_transform.y = welded[i].y;
+        mesh->vertices[i].local_transform.z = welded[i].z;
+        mesh->vertices[i].perspective = mesh->vertices[i].local_transform;
+    }
+
+    int max_edges = 0;
+    for (i = 0; i < mesh->polygons_added; i++) {
+        for (k = 0; k < mesh->polygons[i]->vertices_added; k++) {
+            mesh->polygons[i]->indices[k] = remap[mesh->polygons[i]->indices[k]];
+        }
+        max_edges += mesh->polygons[i]->vertices_added;
+    }
+    free_mesh_data(mesh, mesh->edges);
+    mesh->edges = engine_malloc(sizeof(Edge)*max_edges + 1, MEMORY_GEOMETRY);
+    int num_edges = 0;
+    Polygon* poly;
+    for (i = 0; i < mesh->polygons_added; i++) {
+        poly = mesh->polygons[i];
+        //A 2 vertex polygon is a single segment, anything bigger is closed
+        int count = poly->vertices_added == 2 ? 1 : poly->vertices_added;
+        for (k = 0; k < count; k++) {
+            int v1 = poly->indices[k];
+            int v2 = poly->indices[(k + 1) % poly->vertices_added];
+            if (v1 == v2) { continue; }
+            mesh->edges[num_edges].a = v1 < v2 ? v1 : v2;
+            mesh->edges[num_edges].b = v1 < v2 ? v2 : v1;
+            num_edges++;
+        }
+    }
+    qsort(mesh->edges, num_edges, sizeof(Edge), compare_edges);
+    j = 0;
+    for (i = 0; i < num_edges; i++) {
+        if (j == 0 || compare_edges(mesh->edges + j - 1, mesh->edges + i) != 0) {
+            mesh->edges[j] = mesh->edges[i];
+            j++;
+        }
+    }
+    mesh->num_edges = j;
+
+    for (i = 0; i < mesh->vertices_added; i++) {
+        Vector3 p = mesh->positions[i];
+        if (i == 0 || p.x < mesh->bounds_min.x) { mesh->bounds_min.x = p.x; }
+        if (i == 0 || p.y < mesh->bounds_min.y) { mesh->bounds_min.y = p.y; }
+        if (i == 0 || p.z < mesh->bounds_min.z) { mesh->bounds_min.z = p.z; }
+        if (i == 0 || p.x > mesh->bounds_max.x) { mesh->bounds_max.x = p.x; }
+        if (i == 0 || p.y > mesh->bounds_max.y) { mesh->bounds_max.y = p.y; }
+        if (i == 0 || p.z > mesh->bounds_max.z) { mesh->bounds_max.z = p.z; }
+    }
+    free_mesh_data(mesh, mesh->face_light);
+    free_mesh_data(mesh, mesh->vertex_light);
+    mesh->face_light = engine_malloc(sizeof(float)*mesh->polygons_added + 1, MEMORY_FRAME);
+    mesh->vertex_light = engine_malloc(sizeof(float)*mesh->vertices_added + 1, MEMORY_FRAME);
+    mesh->lit_version = -1;
+    mesh->transform_valid = 0;
+    mesh->cached_valid = 0;
+    mesh->built = 1;
+    engine_free(keys);
+    engine_free(remap);
+}
+
+//Switch a built mesh to the compact source format: 16-bit positions inside its bounding box plus
+//octahedral vertex normals, then drop the double positions. Precision is the box size / 65535 per axis.
+void compress_mesh(Mesh* mesh) {
+    if (!mesh->built) { build_mesh(mesh); }
+    if (mesh->packed != NULL) { return; }
+    int nv = mesh->vertices_added;
+    int i, k;
+    Vector3 size;
+    size.x = mesh->bounds_max.x - mesh->bounds_min.x;
+    size.y = mesh->bounds_max.y - mesh->bounds_min.y;
+    size.z = mesh->bounds_max.z - mesh->bounds_min.z;
+    mesh->quant_scale.x = size.x > 0 ? size.x/65535 : 0;
+    mesh->quant_scale.y = size.y > 0 ? size.y/65535 : 0;
+    mesh->quant_scale.z = size.z > 0 ? size.z/65535 : 0;
+
+    Vector3* normals = engine_calloc(nv + 1, sizeof(Vector3), MEMORY_GEOMETRY);
+    float* px = engine_malloc(sizeof(float)*3*nv + 1, MEMORY_GEOMETRY); //Relative to center, keeps float precision
+    float* py = px + nv;
+    float* pz = py + nv;
+    for (i = 0; i < nv; i++) {
+        px[i] = mesh->positions[i].x - mesh->center.x;
+        py[i] = mesh->positions[i].y - mesh->center.y;
+        pz[i] = mesh->positions[i].z - mesh->center.z;
+    }
+    Vector3 origin = {0, 0, 0};
+    Vector3 normal, centroid;
+    Polygon* poly;
+    for (i = 0; i < mesh->polygons_added; i++) {
+        poly = mesh->polygons[i];
+        polygon_normal(poly, px, py, pz, origin, &normal, &centroid);
+        for (k = 0; k < poly->vertices_added; k++) {
+            normals[poly->indices[k]].x += normal.x;
+            normals[poly->indices[k]].y += normal.y;
+            normals[poly->indices[k]].z += normal.z;
+        }
+    }
+    mesh->packed = engine_malloc(sizeof(PackedVertex)*nv + 1, MEMORY_GEOMETRY);
+    Vector3 p;
+    for (i = 0; i < nv; i++) {
+        p = mesh->positions[i];
+        mesh->packed[i].x = size.x > 0 ? (Uint16)floor((p.x - mesh->bounds_min.x)/size.x*65535 + 0.5) : 0;
+        mesh->packed[i].y = size.y > 0 ? (Uint16)floor((p.y - mesh->bounds_min.y)/size.y*65535 + 0.5) : 0;
+        mesh->packed[i].z = size.z > 0 ? (Uint16)floor((p.z - mesh->bounds_min.z)/size.z*65535 + 0.5) : 0;
+        encode_octahedral(normals[i], mesh->packed[i].normal);
+    }
+    engine_free(normals);
+    engine_free(px);
+    free_mesh_data(mesh, mesh->positions);
+    mesh->positions = NULL;
+    mesh->num_vertices = nv;
+    mesh->transform_valid = 0;
+    mesh->cached_valid = 0;
+}
+
+//Fraction of polygon corners that miss a FIFO post-transform cache, per triangle (ACMR).
+//A polygon counts as vertices_added - 2 triangles, the way fill_triangle fans it. 0.5 is the ideal for big grids.
+double mesh_acmr(Mesh* mesh) {
+    int* stamp = engine_malloc(sizeof(int)*mesh->vertices_added + 1, MEMORY_GEOMETRY); //Time each vertex entered the cache
+    int i, k, misses = 0, triangles = 0, clock = 0;
+    for (i = 0; i < mesh->vertices_added; i++) { stamp[i] = -VERTEX_CACHE_SIZE - 1; }
+    Polygon* poly;
+    for (i = 0; i < mesh->polygons_added; i++) {
+        poly = mesh->polygons[i];
+        for (k = 0; k < poly->vertices_added; k++) {
+            if (clock - stamp[poly->indices[k]] > VERTEX_CACHE_SIZE) {
+                stamp[poly->indices[k]] = clock;
+                clock++;
+                misses++;
+            }
+        }
+        triangles += poly->vertices_added > 3 ? poly->vertices_added - 2 : 1;
+    }
+    engine_free(stamp);
+    return triangles > 0 ? (double)misses/triangles : 0;
+}
+
+//1 if the corner's vertex already appeared earlier in the polygon. Welding can fold two corners together.
+int repeated_corner(Polygon* poly, int k) {
+    int j;
+    for (j = 0; j < k; j++) {
+        if (poly->indices[j] == poly->indices[k]) { return 1; }
+    }
+    return 0;
+}
+
+//Forsyth's vertex score: recently used vertices are cheap to reuse, and vertices with few
+//polygons left get a boost so they're finished off instead of leaving stragglers behind.
+float vertex_cache_score(int cache_position, int remaining) {
+    if (remaining == 0) { return -1; }
+    float score = 0;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            score = 0.75f; //Just used by the last polygon, fixed so it isn't favored too much
+        } else {
+            score = powf(1.0f - (float)(cache_position - 3)/(VERTEX_CACHE_SIZE - 3), 1.5f);
+        }
+    }
+    return score + 2.0f/sqrtf((float)remaining);
+}
+
+//Reorder polygons for post-transform vertex reuse, then renumber the pool in first use order so the
+//transform and raster stages walk memory forward. Works on full and packed meshes.
+//Invalidates cached transforms and lighting. acmr_before and acmr_after may be NULL.
+void optimize_mesh(Mesh* mesh, double* acmr_before, double* acmr_after) {
+    if (!mesh->built) { build_mesh(mesh); }
+    if (acmr_before != NULL) { *acmr_before = mesh_acmr(mesh); }
+    int nv = mesh->vertices_added;
+    int np = mesh->polygons_added;
+    int i, j, k;
+    Polygon* poly;
+
+    //Vertex to polygon adjacency, compressed rows. A polygon is listed once per distinct vertex.
+    int* remaining = engine_calloc(nv + 1, sizeof(int), MEMORY_GEOMETRY);
+    int* first = engine_malloc(sizeof(int)*(nv + 1), MEMORY_GEOMETRY);
+    for (i = 0; i < np; i++) {
+        for (k = 0; k < mesh->polygons[i]->vertices_added; k++) {
+            if (repeated_corner(mesh->polygons[i], k)) { continue; }
+            remaining[mesh->polygons[i]->indices[k]]++;
+        }
+    }
+    first[0] = 0;
+    for (i = 0; i < nv; i++) { first[i + 1] = first[i] + remaining[i]; }
+    int* adjacent = engine_malloc(sizeof(int)*first[nv] + 1, MEMORY_GEOMETRY);
+    int* fill = engine_malloc(sizeof(int)*nv + 1, MEMORY_GEOMETRY);
+    memcpy(fill, first, sizeof(int)*nv);
+    for (i = 0; i < np; i++) {
+        for (k = 0; k < mesh->polygons[i]->vertices_added; k++) {
+            if (repeated_corner(mesh->polygons[i], k)) { continue; }
+            adjacent[fill[mesh->polygons[i]->indices[k]]++] = i;
+        }
+    }
+
+    int* cache_position = engine_malloc(sizeof(int)*nv + 1, MEMORY_GEOMETRY);
+    float* vertex_score = engine_malloc(sizeof(float)*nv + 1, MEMORY_GEOMETRY);
+    for (i = 0; i < nv; i++) {
+        cache_position[i] = -1;
+        vertex_score[i] = vertex_cache_score(-1, remaining[i]);
+    }
+    float* polygon_score = engine_malloc(sizeof(float)*np + 1, MEMORY_GEOMETRY);
+    char* emitted = engine_calloc(np + 1, 1, MEMORY_GEOMETRY);
+    for (i = 0; i < np; i++) {
+        polygon_score[i] = 0;
+        for (k = 0; k < mesh->polygons[i]->vertices_added; k++) {
+            if (repeated_corner(mesh->polygons[i], k)) { continue; }
+            polygon_score[i] += vertex_score[mesh->polygons[i]->indices[k]];
+        }
+    }
+
+    //LRU cache simulation. Room for a full cache plus the polygon being pushed in front of it.
+    int max_corners = 0;
+    for (i = 0; i < np; i++) {
+        if (mesh->polygons[i]->vertices_added > max_corners) { max_corners = mesh->polygons[i]->vertices_added; }
+    }
+    int* cache = engine_malloc(sizeof(int)*(VERTEX_CACHE_SIZE + max_corners) + 1, MEMORY_GEOMETRY);
+    int* next_cache = engine_malloc(sizeof(int)*(VERTEX_CACHE_SIZE + max_corners) + 1, MEMORY_GEOMETRY);
+    int cache_size = 0;
+    Polygon** order = engine_malloc(sizeof(Polygon*)*np + 1, MEMORY_GEOMETRY);
+    int best = -1, scan = 0;
+    for (i = 0; i < np; i++) {
+        if (best < 0) { //Nothing in the cache touches a live polygon, restart at the first one left
+            for (; scan < np && emitted[scan]; scan++) { }
+            best = scan;
+        }
+        poly = mesh->polygons[best];
+        order[i] = poly;
+        emitted[best] = 1;
+
+        //Move the polygon's vertices to the front and drop it from their adjacency lists
+        int next_size = 0;
+        for (k = 0; k < poly->vertices_added; k++) {
+            int v = poly->indices[k];
+            if (cache_position[v] == -2) { continue; } //Repeated corner
+            next_cache[next_size++] = v;
+            cache_position[v] = -2;
+            for (j = first[v]; j < first[v] + remaining[v]; j++) {
+                if (adjacent[j] == best) {
+                    adjacent[j] = adjacent[first[v] + remaining[v] - 1];
+                    remaining[v]--;
+                    break;
+                }
+            }
+        }
+        for (j = 0; j < cache_size; j++) {
+            if (cache_position[cache[j]] != -2) { next_cache[next_size++] = cache[j]; }
+        }
+        for (j = 0; j < next_size; j++) { cache_position[next_cache[j]] = -1; }
+        cache_size = next_size < VERTEX_CACHE_SIZE ? next_size : VERTEX_CACHE_SIZE;
+        for (j = 0; j < next_size; j++) {
+            cache[j] = next_cache[j];
+            cache_position[cache[j]] = j < VERTEX_CACHE_SIZE ? j : -1;
+        }
+
+        //Rescore everything the cache touches (including vertices that just fell out) and pick the next polygon
+        for (j = 0; j < next_size; j++) {
+            int v = next_cache[j];
+            float delta = vertex_cache_score(cache_position[v], remaining[v]) - vertex_score[v];
+            vertex_score[v] += delta;
+            for (k = first[v]; k < first[v] + remaining[v]; k++) {
+                polygon_score[adjacent[k]] += delta;
+            }
+        }
+        best = -1;
+        for (j = 0; j < cache_size; j++) {
+            int v = cache[j];
+            for (k = first[v]; k < first[v] + remaining[v]; k++) {
+                if (emitted[adjacent[k]]) { continue; }
+                if (best < 0 || polygon_score[adjacent[k]] > polygon_score[best]) { best = adjacent[k]; }
+            }
+        }
+    }
+    memcpy(mesh->polygons, order, sizeof(Polygon*)*np);
+
+    //Renumber the pool by first use. Vertices no polygon references keep their relative order at the end.
+    int* remap = fill;
+    for (i = 0; i < nv; i++) { remap[i] = -1; }
+    int next = 0;
+    for (i = 0; i < np; i++) {
+        for (k = 0; k < mesh->polygons[i]->vertices_added; k++) {
+            if (remap[mesh->polygons[i]->indices[k]] < 0) { remap[mesh->polygons[i]->indices[k]] = next++; }
+        }
+    }
+    for (i = 0; i < nv; i++) {
+        if (remap[i] < 0) { remap[i] = next++; }
+    }
+    for (i = 0; i < np; i++) {
+        for (k = 0; k < mesh->polygons[i]->vertices_added; k++) {
+            mesh->polygons[i]->indices[k] = remap[mesh->polygons[i]->indices[k]];
+        }
+    }
+    if (mesh->packed != NULL) {
+        PackedVertex* packed = engine_malloc(sizeof(PackedVertex)*nv + 1, MEMORY_GEOMETRY);
+        for (i = 0; i < nv; i++) { packed[remap[i]] = mesh->packed[i]; }
+        free_mesh_data(mesh, mesh->packed);
+        mesh->packed = packed;
+    } else {
+        Vector3* positions = engine_malloc(sizeof(Vector3)*nv + 1, MEMORY_GEOMETRY);
+        for (i = 0; i < nv; i++) { positions[remap[i]] = mesh->positions[i]; }
+        free_mesh_data(mesh, mesh->positions);
+        mesh->positions = positions;
+        mesh->num_vertices = nv;
+    }
+    for (i = 0; i < mesh->num_edges; i++) {
+        int a = remap[mesh->edges[i].a], b = remap[mesh->edges[i].b];
+        mesh->edges[i].a = a < b ? a : b;
+        mesh->edges[i].b = a < b ? b : a;
+    }
+    qsort(mesh->edges, mesh->num_edges, sizeof(Edge), compare_edges);
+    mesh->lit_version = -1;
+    mesh->transform_valid = 0;
+    mesh->cached_valid = 0;
+
+    engine_free(remaining);
+    engine_free(first);
+    engine_free(adjacent);
+    engine_free(fill);
+    engine_free(cache_position);
+    engine_free(vertex_score);
+    engine_free(polygon_score);
+    engine_free(emitted);
+    engine_free(cache);
+    engine_free(next_cache);
+    engine_free(order);
+    if (acmr_after != NULL) { *acmr_after = mesh_acmr(mesh); }
+}
+
+//Add mesh to world, growing the list if it is full
+void add_mesh(World* world, Mesh* mesh) {
+    if (!mesh->built) {
+        build_mesh(mesh);
+    }
+    if (world->meshes_added >= world->num_meshes) {
+        world->num_meshes = world->num_meshes*2 + 8;
+        world->meshes = engine_realloc(world->meshes, sizeof(Mesh*)*world->num_meshes, MEMORY_GEOMETRY);
+    }
+    world->meshes[world->meshes_added] = mesh;
+    world->meshes_added += 1;
+}
+
+//Take a mesh out of the world without freeing it. Order isn't preserved, the depth buffer doesn't need it.
+void remove_mesh(World* world, Mesh* mesh) {
+    int i;
+    for (i = 0; i < world->meshes_added; i++) {
+        if (world->meshes[i] == mesh) {
+            world->meshes[i] = world->meshes[world->meshes_added - 1];
+            world->meshes_added -= 1;
+            return;
+        }
+    }
+}
+
+//Spread the low 10 bits of x out to every third bit
+Uint32 spread_bits_3(Uint32 x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+typedef struct MeshKey {
+    Uint32 code;
+    Mesh* mesh;
+} MeshKey;
+
+int compare_mesh_keys(const void* p1, const void* p2) {
+    Uint32 a = ((const MeshKey*)p1)->code;
+    Uint32 b = ((const MeshKey*)p2)->code;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+//Optimize every mesh in the world, then sort the mesh list along a 3D Morton curve of the box centers
+//so neighbouring meshes are culled, transformed and rasterized close together. Prints before/after ACMR if report is set.
+void optimize_world(World* world, int report) {
+    int i;
+    int weight = 0;
+    double before, after, total_before = 0, total_after = 0;
+    Vector3 low, high, mid;
+    MeshKey* keys = engine_malloc(sizeof(MeshKey)*world->meshes_added + 1, MEMORY_GEOMETRY);
+    for (i = 0; i < world->meshes_added; i++) {
+        Mesh* mesh = world->meshes[i];
+        optimize_mesh(mesh, &before, &after);
+        total_before += before*mesh->polygons_added; //Weighted so big meshes dominate, like they do the frame time
+        total_after += after*mesh->polygons_added;
+        weight += mesh->polygons_added;
+        mid.x = (mesh->bounds_min.x + mesh->bounds_max.x)/2;
+        mid.y = (mesh->bounds_min.y + mesh->bounds_max.y)/2;
+        mid.z = (mesh->bounds_min.z + mesh->bounds_max.z)/2;
+        if (i == 0 || mid.x < low.x) { low.x = mid.x; }
+        if (i == 0 || mid.y < low.y) { low.y = mid.y; }
+        if (i == 0 || mid.z < low.z) { low.z = mid.z; }
+        if (i == 0 || mid.x > high.x) { high.x = mid.x; }
+        if (i == 0 || mid.y > high.y) { high.y = mid.y; }
+        if (i == 0 || mid.z > high.z) { high.z = mid.z; }
+    }
+    for (i = 0; i < world->meshes_added; i++) {
+        Mesh* mesh = world->meshes[i];
+        mid.x = (mesh->bounds_min.x + mesh->bounds_max.x)/2;
+        mid.y = (mesh->bounds_min.y + mesh->bounds_max.y)/2;
+        mid.z = (mesh->bounds_min.z + mesh->bounds_max.z)/2;
+        Uint32 x = high.x > low.x ? (Uint32)((mid.x - low.x)/(high.x - low.x)*1023) : 0;
+        Uint32 y = high.y > low.y ? (Uint32)((mid.y - low.y)/(high.y - low.y)*1023) : 0;
+        Uint32 z = high.z > low.z ? (Uint32)((mid.z - low.z)/(high.z - low.z)*1023) : 0;
+        keys[i].code = spread_bits_3(x) | (spread_bits_3(y) << 1) | (spread_bits_3(z) << 2);
+        keys[i].mesh = mesh;
+    }
+    qsort(keys, world->meshes_added, sizeof(MeshKey), compare_mesh_keys);
+    for (i = 0; i < world->meshes_added; i++) {
+        world->meshes[i] = keys[i].mesh;
+    }
+    engine_free(keys);
+    if (report && weight > 0) {
+        printf("ACMR %.3f -> %.3f over %d meshes\n", total_before/weight, total_after/weight, world->meshes_added);
+    }
+}
+
+//Project each pool vertex to the screen once, shared by every polygon and edge that uses it
+void project_mesh(Mesh* mesh, Vector3* translation) {
+    int i;
+    Vertex* v;
+    double depth, sx, sy;
+    for (i = 0; i < mesh->vertices_added; i++) {
+        v = &(mesh->vertices[i]);
+        depth = v->perspective.z + translation->z;
+        v->in_front = depth > near_plane;
+        if (!v->in_front) { continue; }
+        sx = padding_left + (v->perspective.x - translation->x)*(focal_length/depth);
+        sy = HEIGHT - (padding_bottom + (v->perspective.y + translation->y)*(focal_length/depth));
+        //Keep very close points from overflowing the int conversion, clip_line handles the rest
+        if (sx < -1000000) { sx = -1000000; } else if (sx > 1000000) { sx = 1000000; }
+        if (sy < -1000000) { sy = -1000000; } else if (sy > 1000000) { sy = 1000000; }
+        v->screen_x = (int)sx;
+        v->screen_y = (int)sy;
+        v->inv_depth = 1/depth;
+    }
+}
+
+void lerp_raster_vertex(RasterVertex* a, RasterVertex* b, float t, RasterVertex* out) {
+    out->x = a->x + (b->x - a->x)*t;
+    out->inv_z = a->inv_z + (b->inv_z - a->inv_z)*t;
+    out->r = a->r + (b->r - a->r)*t;
+    out->g = a->g + (b->g - a->g)*t;
+    out->b = a->b + (b->b - a->b)*t;
+    out->u_z = a->u_z + (b->u_z - a->u_z)*t;
+    out->v_z = a->v_z + (b->v_z - a->v_z)*t;
+}
+
+Uint32 modulate(Uint32 texel, int r, int g, int b) {
+    return (texel & 0xff000000) |
+        (((((texel >> 16) & 255)*r) >> 8) << 16) |
+        (((((texel >> 8) & 255)*g) >> 8) << 8) |
+        ((((texel & 255)*b) >> 8));
+}
+
+//dst = dst*(1 - alpha) + src*alpha over n pixels, four at a time with SSE2. Output is opaque.
+void blend_span(Uint32* dst, Uint32* src, int n, int alpha) {
+    int i = 0;
+    Uint32 a = alpha + (alpha >> 7); //255 maps to 256 so a full alpha is exact
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i src_weight = _mm_set1_epi16(a);
+    __m128i dst_weight = _mm_set1_epi16(256 - a);
+    __m128i opaque = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((__m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((__m128i*)(dst + i));
+        //Channels widened to 16 bits, 255*256 still fits unsigned
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), src_weight),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), dst_weight));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), src_weight),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), dst_weight));
+        __m128i out = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(out, opaque));
+    }
+#endif
+    Uint32 s, d;
+    for (; i < n; i++) {
+        s = src[i];
+        d = dst[i];
+        dst[i] = 0xff000000 |
+            (((((s >> 16) & 255)*a + ((d >> 16) & 255)*(256 - a)) >> 8) << 16) |
+            (((((s >> 8) & 255)*a + ((d >> 8) & 255)*(256 - a)) >> 8) << 8) |
+            (((s & 255)*a + (d & 255)*(256 - a)) >> 8);
+    }
+}
+
+//Fill a span between two edge crossings, keeping the nearest inverse depth per pixel.
+//Translucent spans are depth tested but don't write depth: they're shaded into span_pixels, which starts
+//as a copy of the row so failed pixels blend with themselves, then composited in one pass.
+void fill_span(Framebuffer* fb, int y, RasterVertex* a, RasterVertex* b, RasterState* state) {
+    RasterVertex* tmp;
+    if (a->x > b->x) { tmp = a; a = b; b = tmp; }
+    int x0 = (int)ceilf(a->x);
+    int x1 = (int)ceilf(b->x);
+    if (x0 < 0) { x0 = 0; }
+    if (x1 > fb->width) { x1 = fb->width; }
+    if (x0 >= x1) { return; }
+    float inv_w = 1/(b->x - a->x);
+    float step = x0 - a->x;
+    float dz = (b->inv_z - a->inv_z)*inv_w;
+    float z = a->inv_z + step*dz;
+    Uint32* row = fb->pixels + y*fb->width;
+    Uint32* pixel = row;
+    float* depth = fb->depth + y*fb->width;
+    float* depth_out = depth;
+    int x;
+    if (state->alpha < 255) {
+        memcpy(fb->span_pixels + x0, row + x0, sizeof(Uint32)*(x1 - x0));
+        pixel = fb->span_pixels;
+        depth_out = fb->span_depth;
+    }
+    if (state->texels != NULL) {
+        float du = (b->u_z - a->u_z)*inv_w, dv = (b->v_z - a->v_z)*inv_w;
+        float u = a->u_z + step*du, v = a->v_z + step*dv;
+        float dr = (b->r - a->r)*inv_w, dg = (b->g - a->g)*inv_w, db = (b->b - a->b)*inv_w;
+        float r = a->r + step*dr, g = a->g + step*dg, bl = a->b + step*db;
+        int size = state->texture_size;
+        int mask = size - 1;
+        int tu, tv;
+        for (x = x0; x < x1; x++) {
+            if (z > depth[x]) {
+                depth_out[x] = z;
+                tu = (int)floorf(u/z*size) & mask; //Wraps, including negative coordinates
+                tv = (int)floorf(v/z*size) & mask;
+                pixel[x] = modulate(state->texels[morton_index(tu, tv)], (int)r, (int)g, (int)bl);
+            }
+            z += dz; u += du; v += dv; r += dr; g += dg; bl += db;
+        }
+    } else if (state->shading == SHADE_GOURAUD) {
+        float dr = (b->r - a->r)*inv_w, dg = (b->g - a->g)*inv_w, db = (b->b - a->b)*inv_w;
+        float r = a->r + step*dr, g = a->g + step*dg, bl = a->b + step*db;
+        for (x = x0; x < x1; x++) {
+            if (z > depth[x]) {
+                depth_out[x] = z;
+                pixel[x] = 0xff000000 | ((Uint32)r << 16) | ((Uint32)g << 8) | (Uint32)bl;
+            }
+            z += dz; r += dr; g += dg; bl += db;
+        }
+    } else {
+        Uint32 color = state->color;
+        for (x = x0; x < x1; x++) {
+            if (z > depth[x]) {
+                depth_out[x] = z;
+                pixel[x] = color;
+            }
+            z += dz;
+        }
+    }
+    if (state->alpha < 255) {
+        blend_span(row + x0, fb->span_pixels + x0, x1 - x0, state->alpha);
+    }
+}
+
+//Scanline fill of one triangle, pixel centers sit on integer coordinates
+void fill_triangle(Framebuffer* fb, RasterVertex* v0, RasterVertex* v1, RasterVertex* v2, RasterState* state) {
+    RasterVertex* tmp;
+    if (v1->y < v0->y) { tmp = v0; v0 = v1; v1 = tmp; }
+    if (v2->y < v0->y) { tmp = v0; v0 = v2; v2 = tmp; }
+    if (v2->y < v1->y) { tmp = v1; v1 = v2; v2 = tmp; }
+    if (v2->y == v0->y) { return; }
+    int y_start = (int)ceilf(v0->y);
+    int y_end = (int)ceilf(v2->y);
+    if (y_start < 0) { y_start = 0; }
+    if (y_end > fb->height) { y_end = fb->height; }
+    int y;
+    RasterVertex a, b;
+    for (y = y_start; y < y_end; y++) {
+        lerp_raster_vertex(v0, v2, (y - v0->y)/(v2->y - v0->y), &a); //Long edge
+        if (y < v1->y) {
+            lerp_raster_vertex(v0, v1, (y - v0->y)/(v1->y - v0->y), &b);
+        } else {
+            lerp_raster_vertex(v1, v2, (y - v1->y)/(v2->y - v1->y), &b);
+        }
+        fill_span(fb, y, &a, &b, state);
+    }
+}
+
+SDL_Color shade_color(SDL_Color color, float light) {
+    if (light > 1) { light = 1; }
+    color.r = color.r*light;
+    color.g = color.g*light;
+    color.b = color.b*light;
+    return color;
+}
+
+//One mip level per polygon, from how many texels land on each covered pixel
+int select_mip_level(Texture* texture, RasterVertex* points, float* uvs, int n) {
+    double screen_area = 0, uv_area = 0;
+    int i, j;
+    for (i = 0; i < n; i++) {
+        j = (i + 1) % n;
+        screen_area += points[i].x*points[j].y - points[j].x*points[i].y;
+        uv_area += uvs[2*i]*uvs[2*j + 1] - uvs[2*j]*uvs[2*i + 1];
+    }
+    screen_area = fabs(screen_area);
+    uv_area = fabs(uv_area)*texture->sizes[0]*texture->sizes[0];
+    if (screen_area < 1) { return texture->num_levels - 1; }
+    if (!(uv_area > 0)) { return 0; } //Degenerate UVs (all corners at one texel) would feed log2 a 0
+    int level = (int)(0.5*log2(uv_area/screen_area));
+    if (level < 0) { level = 0; }
+    if (level > texture->num_levels - 1) { level = texture->num_levels - 1; }
+    return level;
+}
+
+//Render a polygon
+void render_polygon(Framebuffer* fb, Mesh* mesh, int index, int shading) {
+    //Shading happens here, from the lighting cached on the mesh by light_mesh
+    //Fill only, outlines come from the mesh edge list. Polygons are convex so a fan covers them.
+    Polygon* polygon = mesh->polygons[index];
+    int num_vertices = polygon->num_vertices;
+    if (num_vertices < 3) { return; } //Lines have no area, render_mesh_edges draws them
+    RasterVertex points[num_vertices];
+    Vertex* vertex;
+    SDL_Color flat = shade_color(polygon->color, mesh->face_light[index]);
+    SDL_Color lit = flat;
+    int i;
+    for (i = 0; i < num_vertices; i++) {
+        vertex = &(mesh->vertices[polygon->indices[i]]);
+        if (!vertex->in_front) { return; }
+        points[i].x = vertex->screen_x;
+        points[i].y = vertex->screen_y;
+        points[i].inv_z = vertex->inv_depth;
+        points[i].u_z = polygon->uvs[2*i]*vertex->inv_depth;
+        points[i].v_z = polygon->uvs[2*i + 1]*vertex->inv_depth;
+        if (shading == SHADE_GOURAUD) {
+            lit = shade_color(polygon->color, mesh->vertex_light[polygon->indices[i]]);
+        }
+        points[i].r = lit.r;
+        points[i].g = lit.g;
+        points[i].b = lit.b;
+    }
+    RasterState state;
+    state.color = map_color(flat);
+    state.shading = shading;
+    state.texels = NULL;
+    state.alpha = polygon->color.a;
+    if (polygon->texture != NULL) {
+        int level = select_mip_level(polygon->texture, points, polygon->uvs, num_vertices);
+        state.texels = polygon->texture->levels[level];
+        state.texture_size = polygon->texture->sizes[level];
+    }
+    for (i = 1; i < num_vertices - 1; i++) {
+        fill_triangle(fb, &points[0], &points[i], &points[i+1], &state);
+    }
+}
+
+//Draw each unique edge once, endpoints were already projected by project_mesh. Edges behind filled faces fail draw_line's depth test.
+void render_mesh_edges(Framebuffer* fb, Mesh* mesh, Uint32 color) {
+    int i;
+    Vertex* v1;
+    Vertex* v2;
+    for (i = 0; i < mesh->num_edges; i++) {
+        v1 = &(mesh->vertices[mesh->edges[i].a]);
+        v2 = &(mesh->vertices[mesh->edges[i].b]);
+        if (!v1->in_front || !v2->in_front) { continue; }
+        draw_line(fb, v1->screen_x, v1->screen_y, v1->inv_depth, v2->screen_x, v2->screen_y, v2->inv_depth, color);
+    }
+}
+
+//Queue a translucent polygon for render_world's back to front pass.
+//The key is the mean view depth as float bits, which order like the floats themselves when positive.
+void defer_transparent(World* world, Mesh* mesh, int index, Vector3* translation) {
+    Polygon* polygon = mesh->polygons[index];
+    float depth = 0;
+    int k;
+    if (polygon->vertices_added < 3) { return; }
+    for (k = 0; k < polygon->vertices_added; k++) {
+        Vertex* vertex = &(mesh->vertices[polygon->indices[k]]);
+        if (!vertex->in_front) { return; }
+        depth += vertex->perspective.z + translation->z;
+    }
+    depth /= polygon->vertices_added;
+    if (world->transparent_added >= world->num_transparent) {
+        world->num_transparent = world->num_transparent*2 + 64;
+        world->transparent = engine_realloc(world->transparent, sizeof(TransparentPolygon)*world->num_transparent, MEMORY_FRAME);
+        world->transparent_sorted = engine_realloc(world->transparent_sorted, sizeof(TransparentPolygon)*world->num_transparent, MEMORY_FRAME);
+    }
+    TransparentPolygon* entry = &(world->transparent[world->transparent_added]);
+    Uint32 bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    entry->key = ~bits; //Farthest first
+    entry->index = index;
+    entry->mesh = mesh;
+    world->transparent_added += 1;
+}
+
+//LSD radix sort of the transparent list on key, a byte per pass. Linear in the number of polygons,
+//and passes where every key has the same byte (usually the exponent's high bits) are skipped.
+void sort_transparent(World* world) {
+    int n = world->transparent_added;
+    int counts[4][256];
+    int i, pass, digit;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++) {
+        Uint32 key = world->transparent[i].key;
+        counts[0][key & 255]++;
+        counts[1][(key >> 8) & 255]++;
+        counts[2][(key >> 16) & 255]++;
+        counts[3][key >> 24]++;
+    }
+    TransparentPolygon* tmp;
+    for (pass = 0; pass < 4; pass++) {
+        int shift = 8*pass;
+        if (n == 0 || counts[pass][(world->transparent[0].key >> shift) & 255] == n) { continue; }
+        int offset = 0, count;
+        for (digit = 0; digit < 256; digit++) {
+            count = counts[pass][digit];
+            counts[pass][digit] = offset;
+            offset += count;
+        }
+        for (i = 0; i < n; i++) {
+            digit = (world->transparent[i].key >> shift) & 255;
+            world->transparent_sorted[counts[pass][digit]++] = world->transparent[i];
+        }
+        tmp = world->transparent;
+        world->transparent = world->transparent_sorted;
+        world->transparent_sorted = tmp;
+    }
+}
+
+//Render each of a mesh's opaque polygons, then outline in white. Translucent ones wait for render_world.
+void render_mesh(Framebuffer* fb, World* world, Mesh* mesh, Vector3* translation) {
+    project_mesh(mesh, translation);
+    if (!world->wireframe) {
+        int i = 0;
+        while (i < mesh->polygons_added) {
+            //Render polygons in order.
+            if (mesh->polygons[i]->color.a < SDL_ALPHA_OPAQUE) {
+                defer_transparent(world, mesh, i, translation);
+            } else {
+                render_polygon(fb, mesh, i, world->shading);
+            }
+            i++;
+        }
+    }
+    render_mesh_edges(fb, mesh, 0xffffffff);
+}
+
+//Render each mesh in a world
+void render_world(Framebuffer* fb, World* world, Vector3* translation) {
+    Mesh** p = world->meshes;
+    int i = 0;
+    world->transparent_added = 0;
+    while (i < world->meshes_added) {
+        //Render meshes in order.
+        //if (*p == NULL) { break; }
+        if ((*p)->re_render == 1 && !(*p)->occluded) {     
+            render_mesh(fb, world, *p, translation);
+            (*p)->re_render = 0;
+        }
+        i++; p++;
+    }
+    //Blend translucent polygons over everything opaque, farthest first. They don't write depth,
+    //so the occlusion pyramid below only ever sees opaque surfaces.
+    sort_transparent(world);
+    for (i = 0; i < world->transparent_added; i++) {
+        render_polygon(fb, world->transparent[i].mesh, world->transparent[i].index, world->shading);
+    }
+    //Next frame's occlusion test reads this frame's depth. Wireframe writes no depth, so nothing can be culled.
+    if (world->occlusion != NULL) {
+        if (world->wireframe) {
+            world->occlusion->valid = 0;
+        } else {
+            build_depth_pyramid(world->occlusion, fb);
+        }
+    }
+}
+
+//For a polygon that never made it into a mesh
+void free_polygon(Polygon* poly) {
+    engine_free(poly->sequence);
+    engine_free(poly->indices);
+    engine_free(poly->uvs);
+    engine_free(poly);
+}
+
+void free_mesh(Mesh* mesh) {
+    int j;
+    for (j = 0; j < mesh->polygons_added; j++) {
+        free_mesh_data(mesh, mesh->polygons[j]->sequence); //NULL unless the polygon was never built into the pool
+        free_mesh_data(mesh, mesh->polygons[j]->indices);
+        free_mesh_data(mesh, mesh->polygons[j]->uvs);
+        free_mesh_data(mesh, mesh->polygons[j]);
+    }
+    free_mesh_data(mesh, mesh->positions);
+    free_mesh_data(mesh, mesh->packed);
+    free_mesh_data(mesh, mesh->vertices);
+    free_mesh_data(mesh, mesh->edges);
+    free_mesh_data(mesh, mesh->face_light);
+    free_mesh_data(mesh, mesh->vertex_light);
+    free_mesh_data(mesh, mesh->polygons);
+    free_mesh_data(mesh, mesh);
+}
+
+#ifdef __linux__
+void unmap_snapshot(Uint8* base, size_t size) { munmap(base, size); }
+#else
+void unmap_snapshot(Uint8* base, size_t size) { engine_free(base); } //Read into memory, there is no mmap
+#endif
+
+void free_world(World* world) {
+    int i;
+    for (i = 0; i < world->meshes_added; i++) {
+        free_mesh(world->meshes[i]);
+    }
+    engine_free(world->meshes);
+    engine_free(world->graph.nodes);
+    engine_free(world->transparent);
+    engine_free(world->transparent_sorted);
+    engine_free(world->light_scratch);
+    SDL_DestroyMutex(world->lock);
+    if (world->snapshot != NULL) { unmap_snapshot(world->snapshot, world->snapshot_size); } //After the meshes that live in it
+    engine_free(world);
+    print("Freed world");
+    count_world(-1);
+#ifndef NDEBUG
+    //With the last world gone no geometry should be left. Free chunk streamers and loose meshes first.
+    MemoryStats stats;
+    get_memory_stats(&stats);
+    if (stats.worlds == 0 && stats.allocations[MEMORY_GEOMETRY] != 0) {
+        fprintf(stderr, "Last world freed with %d geometry blocks (%zu bytes) still allocated\n",
+            stats.allocations[MEMORY_GEOMETRY], stats.bytes[MEMORY_GEOMETRY]);
+        print_memory_stats();
+        fflush(stdout);
+        abort();
+    }
+#endif
+}
+
+//Where the eye is in the space rotate_mesh writes local_transform in. Only matches (t.x, -t.y, -t.z)
+//when the camera isn't rotated.
+Vector3 camera_eye(Vector3 rotation, Vector3 translation) {
+    double camera[3][3];
+    rotation_matrix(rotation, camera);
+    //After the camera rotation the eye sits at (t.x, -t.y, -t.z) looking down +z, see project_mesh
+    Vector3 eye;
+    eye.x = 0;
+    eye.y = -2*translation.y;
+    eye.z = -2*translation.z;
+    //Undo rotate_all_in_world: p = R(w - t) + t, so w = R^T(p - t) + t. R is a rotation, its inverse is its transpose.
+    eye = matrix_transpose_x_vector(camera, eye);
+    eye.x += translation.x;
+    eye.y += translation.y;
+    eye.z += translation.z;
+    return eye;
+}
+
+//Camera ray through a screen point, the inverse of project_mesh. origin and direction come out in the
+//space rotate_mesh writes local_transform in. direction has length 1.
+void camera_ray(Vector3 rotation, Vector3 translation, double screen_x, double screen_y, Vector3* origin, Vector3* direction) {
+    double camera[3][3];
+    rotation_matrix(rotation, camera);
+    Vector3 ray;
+    ray.x = (screen_x - padding_left)/focal_length;
+    ray.y = (HEIGHT - screen_y - padding_bottom)/focal_length;
+    ray.z = 1;
+    *origin = camera_eye(rotation, translation);
+    *direction = matrix_transpose_x_vector(camera, ray);
+    double length = sqrt(direction->x*direction->x + direction->y*direction->y + direction->z*direction->z);
+    direction->x /= length;
+    direction->y /= length;
+    direction->z /= length;
+}
+
+//Slab test against a box, returns whether the ray enters it before max_t. *entry gets the distance it enters at.
+int ray_hits_box(Vector3 origin, Vector3 direction, Vector3 low, Vector3 high, double max_t, double* entry) {
+    double o[3] = { origin.x, origin.y, origin.z };
+    double d[3] = { direction.x, direction.y, direction.z };
+    double l[3] = { low.x, low.y, low.z };
+    double h[3] = { high.x, high.y, high.z };
+    double enter = 0, leave = max_t, t0, t1, tmp;
+    int axis;
+    for (axis = 0; axis < 3; axis++) {
+        if (d[axis] == 0) {
+            if (o[axis] < l[axis] || o[axis] > h[axis]) { return 0; }
+            continue;
+        }
+        t0 = (l[axis] - o[axis])/d[axis];
+        t1 = (h[axis] - o[axis])/d[axis];
+        if (t0 > t1) { tmp = t0; t0 = t1; t1 = tmp; }
+        if (t0 > enter) { enter = t0; }
+        if (t1 < leave) { leave = t1; }
+        if (enter > leave) { return 0; }
+    }
+    *entry = enter;
+    return 1;
+}
+
+//Moller-Trumbore against the batch's triangles, four at a time with SSE2. Double sided, since polygons
+//aren't wound consistently. Returns the lane of a hit nearer than *best_t and updates it, or -1.
+int intersect_triangles(TriangleBatch* batch, float origin[3], float direction[3], float* best_t) {
+    int hit = -1, lane;
+    for (lane = batch->count; lane < 4; lane++) { //Degenerate padding never hits
+        batch->e1[0][lane] = batch->e1[1][lane] = batch->e1[2][lane] = 0;
+        batch->e2[0][lane] = batch->e2[1][lane] = batch->e2[2][lane] = 0;
+    }
+#ifdef __SSE2__
+    __m128 dx = _mm_set1_ps(direction[0]), dy = _mm_set1_ps(direction[1]), dz = _mm_set1_ps(direction[2]);
+    __m128 e1x = _mm_loadu_ps(batch->e1[0]), e1y = _mm_loadu_ps(batch->e1[1]), e1z = _mm_loadu_ps(batch->e1[2]);
+    __m128 e2x = _mm_loadu_ps(batch->e2[0]), e2y = _mm_loadu_ps(batch->e2[1]), e2z = _mm_loadu_ps(batch->e2[2]);
+    //p = d x e2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 epsilon = _mm_set1_ps(1e-9f);
+    __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 valid = _mm_cmpgt_ps(abs_det, epsilon);
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1), _mm_or_ps(_mm_and_ps(valid, det), _mm_andnot_ps(valid, _mm_set1_ps(1))));
+    //s = o - v0
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(origin[0]), _mm_loadu_ps(batch->v0[0]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(origin[1]), _mm_loadu_ps(batch->v0[1]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(origin[2]), _mm_loadu_ps(batch->v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+    //q = s x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+    __m128 zero = _mm_setzero_ps();
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1)));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(*best_t)));
+    int mask = _mm_movemask_ps(valid);
+    if (mask == 0) { return -1; }
+    float ts[4];
+    _mm_storeu_ps(ts, t);
+    for (lane = 0; lane < batch->count; lane++) {
+        if ((mask & (1 << lane)) && ts[lane] < *best_t) {
+            *best_t = ts[lane];
+            hit = lane;
+        }
+    }
+#else
+    for (lane = 0; lane < batch->count; lane++) {
+        float e1[3] = { batch->e1[0][lane], batch->e1[1][lane], batch->e1[2][lane] };
+        float e2[3] = { batch->e2[0][lane], batch->e2[1][lane], batch->e2[2][lane] };
+        float p[3] = { direction[1]*e2[2] - direction[2]*e2[1], direction[2]*e2[0] - direction[0]*e2[2], direction[0]*e2[1] - direction[1]*e2[0] };
+        float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+        if (fabsf(det) <= 1e-9f) { continue; }
+        float inv = 1/det;
+        float s[3] = { origin[0] - batch->v0[0][lane], origin[1] - batch->v0[1][lane], origin[2] - batch->v0[2][lane] };
+        float u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2])*inv;
+        float q[3] = { s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0] };
+        float v = (direction[0]*q[0] + direction[1]*q[1] + direction[2]*q[2])*inv;
+        float t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2])*inv;
+        if (u >= 0 && v >= 0 && u + v <= 1 && t > 0 && t < *best_t) {
+            *best_t = t;
+            hit = lane;
+        }
+    }
+#endif
+    return hit;
+}
+
+//Nearest polygon of one mesh along a ray in the mesh's source space, or -1. Only reads source data,
+//which doesn't change once the mesh is in a world, so it runs without world->lock.
+int ray_scan_mesh(Mesh* mesh, Vector3 model_origin, Vector3 model_direction, float* best_t) {
+    TriangleBatch batch;
+    Vector3 corner;
+    float o[3], d[3];
+    int j, k, lane;
+    //Triangles are relative to bounds_min so the float math keeps its precision far from the origin
+    o[0] = model_origin.x - mesh->bounds_min.x; o[1] = model_origin.y - mesh->bounds_min.y; o[2] = model_origin.z - mesh->bounds_min.z;
+    d[0] = model_direction.x; d[1] = model_direction.y; d[2] = model_direction.z;
+    int best_polygon = -1;
+    batch.count = 0;
+    for (j = 0; j < mesh->polygons_added; j++) {
+        Polygon* poly = mesh->polygons[j];
+        if (poly->vertices_added < 3) { continue; }
+        Vector3 v0 = mesh_position(mesh, poly->indices[0]);
+        Vector3 previous = mesh_position(mesh, poly->indices[1]);
+        for (k = 2; k < poly->vertices_added; k++) { //Fan, like render_polygon
+            corner = mesh_position(mesh, poly->indices[k]);
+            batch.v0[0][batch.count] = v0.x - mesh->bounds_min.x;
+            batch.v0[1][batch.count] = v0.y - mesh->bounds_min.y;
+            batch.v0[2][batch.count] = v0.z - mesh->bounds_min.z;
+            batch.e1[0][batch.count] = previous.x - v0.x;
+            batch.e1[1][batch.count] = previous.y - v0.y;
+            batch.e1[2][batch.count] = previous.z - v0.z;
+            batch.e2[0][batch.count] = corner.x - v0.x;
+            batch.e2[1][batch.count] = corner.y - v0.y;
+            batch.e2[2][batch.count] = corner.z - v0.z;
+            batch.polygon[batch.count] = j;
+            batch.count += 1;
+            previous = corner;
+            if (batch.count == 4) {
+                lane = intersect_triangles(&batch, o, d, best_t);
+                if (lane >= 0) { best_polygon = batch.polygon[lane]; }
+                batch.count = 0;
+            }
+        }
+    }
+    if (batch.count > 0) {
+        lane = intersect_triangles(&batch, o, d, best_t);
+        if (lane >= 0) { best_polygon = batch.polygon[lane]; }
+    }
+    return best_polygon;
+}
+
+//Nearest polygon along a ray, origin and direction in local_transform space. Works from each mesh's
+//source positions and current transform, so it doesn't depend on what was culled or drawn this frame.
+//world->lock is only held while the transforms are read and the boxes tested. The polygon scan runs
+//after it's released, with world->ray_readers keeping evict_chunk from freeing the meshes under it.
+//Any thread can call it while the render thread is running.
+RayHit cast_ray(World* world, Vector3 origin, Vector3 direction) {
+    RayHit result;
+    result.mesh = NULL;
+    result.polygon = -1;
+    result.distance = DBL_MAX;
+    double length = sqrt(direction.x*direction.x + direction.y*direction.y + direction.z*direction.z);
+    if (length == 0) { return result; }
+    direction.x /= length; direction.y /= length; direction.z /= length;
+
+    RayCandidate stack[RAY_CANDIDATES];
+    RayCandidate* candidates = stack;
+    int capacity = RAY_CANDIDATES, count = 0;
+    double transform[3][3];
+    Vector3 offset, local;
+    double along, radius;
+    int i, j;
+    SDL_LockMutex(world->lock);
+    for (i = 0; i < world->meshes_added; i++) {
+        Mesh* mesh = world->meshes[i];
+        if (!mesh->built) { continue; }
+        if (count == capacity) { //Only long rays through big worlds get here
+            RayCandidate* grown = engine_malloc(sizeof(RayCandidate)*capacity*2, MEMORY_OTHER);
+            memcpy(grown, candidates, sizeof(RayCandidate)*count);
+            if (candidates != stack) { engine_free(candidates); }
+            candidates = grown;
+            capacity *= 2;
+        }
+        RayCandidate* candidate = &(candidates[count]);
+        cached_mesh_transform(mesh, &(world->graph), transform, &offset);
+        //Sphere around the box first, most meshes are nowhere near the ray
+        local.x = mesh->cached_sphere_center.x - origin.x;
+        local.y = mesh->cached_sphere_center.y - origin.y;
+        local.z = mesh->cached_sphere_center.z - origin.z;
+        along = local.x*direction.x + local.y*direction.y + local.z*direction.z;
+        radius = mesh->cached_sphere_radius;
+        if (along < -radius || local.x*local.x + local.y*local.y + local.z*local.z - along*along > radius*radius) { continue; }
+        //Move the ray into the mesh's source space instead of moving the mesh: w = M(p - c) + offset
+        local.x = origin.x - offset.x; local.y = origin.y - offset.y; local.z = origin.z - offset.z;
+        candidate->origin = matrix_transpose_x_vector(transform, local);
+        candidate->origin.x += mesh->center.x; candidate->origin.y += mesh->center.y; candidate->origin.z += mesh->center.z;
+        candidate->direction = matrix_transpose_x_vector(transform, direction);
+        if (!ray_hits_box(candidate->origin, candidate->direction, mesh->bounds_min, mesh->bounds_max, DBL_MAX, &(candidate->entry))) { continue; }
+        candidate->mesh = mesh;
+        count += 1;
+    }
+    SDL_AtomicAdd(&(world->ray_readers), 1);
+    SDL_UnlockMutex(world->lock);
+
+    //Nearest box first, so the scan can stop at the first box that starts past the best hit
+    RayCandidate tmp;
+    for (i = 1; i < count; i++) {
+        tmp = candidates[i];
+        for (j = i; j > 0 && candidates[j - 1].entry > tmp.entry; j--) { candidates[j] = candidates[j - 1]; }
+        candidates[j] = tmp;
+    }
+    float best_t = FLT_MAX;
+    int polygon;
+    for (i = 0; i < count && candidates[i].entry < best_t; i++) {
+        polygon = ray_scan_mesh(candidates[i].mesh, candidates[i].origin, candidates[i].direction, &best_t);
+        if (polygon >= 0) {
+            result.mesh = candidates[i].mesh;
+            result.polygon = polygon;
+            result.distance = best_t; //Rotations keep lengths, so distance is the same in every space
+        }
+    }
+    SDL_AtomicAdd(&(world->ray_readers), -1);
+    if (candidates != stack) { engine_free(candidates); }
+    if (result.mesh != NULL) {
+        result.point.x = origin.x + direction.x*result.distance;
+        result.point.y = origin.y + direction.y*result.distance;
+        result.point.z = origin.z + direction.z*result.distance;
+    }
+    return result;
+}
+
+//Mesh and polygon under a screen pixel, for the camera the render thread last used
+RayHit pick_screen(World* world, Vector3 rotation, Vector3 translation, double screen_x, double screen_y) {
+    Vector3 origin, direction;
+    camera_ray(rotation, translation, screen_x, screen_y, &origin, &direction);
+    return cast_ray(world, origin, direction);
+}
+
+//Reserve bytes at the end of the snapshot, 16 byte aligned, copying src in or zeroing them if src is NULL
+size_t snapshot_append(SnapshotWriter* writer, const void* src, size_t bytes) {
+    size_t offset = (writer->size + 15) & ~(size_t)15;
+    if (offset + bytes > writer->capacity) {
+        writer->capacity = (offset + bytes)*2;
+        writer->data = engine_realloc(writer->data, writer->capacity, MEMORY_GEOMETRY);
+    }
+    memset(writer->data + writer->size, 0, offset - writer->size); //Padding too, so the file is deterministic
+    if (src != NULL) {
+        memcpy(writer->data + offset, src, bytes);
+    } else {
+        memset(writer->data + offset, 0, bytes);
+    }
+    writer->size = offset + bytes;
+    return offset;
+}
+
+//Point the pointer at file offset field to target, and record it for the relocation pass
+void snapshot_link(SnapshotWriter* writer, size_t field, size_t target) {
+    uintptr_t value = target;
+    memcpy(writer->data + field, &value, sizeof(value));
+    if (writer->relocations_added >= writer->num_relocations) {
+        writer->num_relocations = writer->num_relocations*2 + 1024;
+        writer->relocations = engine_realloc(writer->relocations, sizeof(Uint64)*writer->num_relocations, MEMORY_GEOMETRY);
+    }
+    writer->relocations[writer->relocations_added] = field;
+    writer->relocations_added += 1;
+}
+
+size_t snapshot_texture(SnapshotWriter* writer, Texture* texture) {
+    int i;
+    for (i = 0; i < writer->textures_added; i++) {
+        if (writer->textures[i] == texture) { return writer->texture_offsets[i]; }
+    }
+    Texture copy = *texture;
+    for (i = 0; i < MAX_MIP_LEVELS; i++) { copy.levels[i] = NULL; }
+    size_t offset = snapshot_append(writer, &copy, sizeof(Texture));
+    for (i = 0; i < texture->num_levels; i++) {
+        size_t level = snapshot_append(writer, texture->levels[i], sizeof(Uint32)*texture->sizes[i]*texture->sizes[i]);
+        snapshot_link(writer, offset + offsetof(Texture, levels) + sizeof(Uint32*)*i, level);
+    }
+    if (writer->textures_added >= writer->num_textures) {
+        writer->num_textures = writer->num_textures*2 + 4;
+        writer->textures = engine_realloc(writer->textures, sizeof(Texture*)*writer->num_textures, MEMORY_GEOMETRY);
+        writer->texture_offsets = engine_realloc(writer->texture_offsets, sizeof(size_t)*writer->num_textures, MEMORY_GEOMETRY);
+    }
+    writer->textures[writer->textures_added] = texture;
+    writer->texture_offsets[writer->textures_added] = offset;
+    writer->textures_added += 1;
+    return offset;
+}
+
+//Source data only, the per-frame arrays are allocated again by load_snapshot. The Polygon structs of a
+//mesh are written as one block, so the relocation pass only dirties those pages and not the vertex data.
+size_t snapshot_mesh(SnapshotWriter* writer, Mesh* mesh) {
+    if (!mesh->built) { build_mesh(mesh); }
+    int nv = mesh->vertices_added;
+    int np = mesh->polygons_added;
+    int j;
+    Mesh copy = *mesh;
+    copy.polygons = NULL;
+    copy.positions = NULL;
+    copy.packed = NULL;
+    copy.vertices = NULL;
+    copy.edges = NULL;
+    copy.face_light = NULL;
+    copy.vertex_light = NULL;
+    copy.mapping = NULL;
+    copy.mapping_size = 0;
+    copy.num_polygons = np;
+    copy.num_vertices = nv;
+    copy.occluded = 0;
+    copy.drawn_nearest = 0;
+    copy.transform_valid = 0;
+    copy.cached_valid = 0;
+    copy.applied_node_version = 0;
+    copy.lit_version = -1;
+    size_t offset = snapshot_append(writer, &copy, sizeof(Mesh));
+    size_t list = snapshot_append(writer, NULL, sizeof(Polygon*)*np);
+    size_t structs = snapshot_append(writer, NULL, sizeof(Polygon)*np);
+    snapshot_link(writer, offset + offsetof(Mesh, polygons), list);
+    Polygon* poly;
+    Polygon poly_copy;
+    for (j = 0; j < np; j++) {
+        poly = mesh->polygons[j];
+        poly_copy = *poly;
+        poly_copy.sequence = NULL;
+        poly_copy.indices = NULL;
+        poly_copy.uvs = NULL;
+        poly_copy.texture = NULL;
+        poly_copy.num_vertices = poly->vertices_added;
+        size_t at = structs + sizeof(Polygon)*j;
+        memcpy(writer->data + at, &poly_copy, sizeof(Polygon));
+        snapshot_link(writer, list + sizeof(Polygon*)*j, at);
+        if (poly->texture != NULL) {
+            snapshot_link(writer, at + offsetof(Polygon, texture), snapshot_texture(writer, poly->texture));
+        }
+    }
+    for (j = 0; j < np; j++) {
+        poly = mesh->polygons[j];
+        size_t at = structs + sizeof(Polygon)*j;
+        snapshot_link(writer, at + offsetof(Polygon, indices), snapshot_append(writer, poly->indices, sizeof(int)*poly->vertices_added));
+        snapshot_link(writer, at + offsetof(Polygon, uvs), snapshot_append(writer, poly->uvs, sizeof(float)*2*poly->vertices_added));
+    }
+    if (mesh->packed != NULL) {
+        snapshot_link(writer, offset + offsetof(Mesh, packed), snapshot_append(writer, mesh->packed, sizeof(PackedVertex)*nv));
+    } else {
+        snapshot_link(writer, offset + offsetof(Mesh, positions), snapshot_append(writer, mesh->positions, sizeof(Vector3)*nv));
+    }
+    snapshot_link(writer, offset + offsetof(Mesh, edges), snapshot_append(writer, mesh->edges, sizeof(Edge)*mesh->num_edges));
+    return offset;
+}
+
+Uint32 snapshot_layout() {
+    return sizeof(World) + sizeof(Mesh) + sizeof(Polygon) + sizeof(Texture) + sizeof(TransformNode);
+}
+
+//Write the whole world as one relocatable file for load_snapshot. Meshes that aren't built yet are built first.
+//Returns 0 if the file couldn't be written.
+int save_snapshot(char* path, World* world, Uint32 user[4]) {
+    SnapshotWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    snapshot_append(&writer, NULL, sizeof(SnapshotHeader));
+
+    World copy = *world;
+    copy.meshes = NULL;
+    copy.num_meshes = world->meshes_added;
+    copy.occlusion = NULL;
+    copy.meshes_culled = 0;
+    copy.graph.nodes = NULL;
+    copy.lock = NULL;
+    SDL_AtomicSet(&(copy.ray_readers), 0);
+    copy.transparent = NULL;
+    copy.transparent_sorted = NULL;
+    copy.num_transparent = 0;
+    copy.transparent_added = 0;
+    copy.light_scratch = NULL;
+    copy.light_scratch_size = 0;
+    copy.snapshot = NULL;
+    copy.snapshot_size = 0;
+    size_t offset = snapshot_append(&writer, &copy, sizeof(World));
+    size_t nodes = snapshot_append(&writer, world->graph.nodes, sizeof(TransformNode)*world->graph.nodes_added);
+    snapshot_link(&writer, offset + offsetof(World, graph.nodes), nodes);
+    size_t list = snapshot_append(&writer, NULL, sizeof(Mesh*)*world->meshes_added);
+    snapshot_link(&writer, offset + offsetof(World, meshes), list);
+    int i;
+    for (i = 0; i < world->meshes_added; i++) {
+        snapshot_link(&writer, list + sizeof(Mesh*)*i, snapshot_mesh(&writer, world->meshes[i]));
+    }
+    size_t relocations = snapshot_append(&writer, writer.relocations, sizeof(Uint64)*writer.relocations_added);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.pointer_size = sizeof(void*);
+    header.layout = snapshot_layout();
+    for (i = 0; i < 4; i++) { header.user[i] = user != NULL ? user[i] : 0; }
+    header.size = writer.size;
+    header.world = offset;
+    header.relocations = relocations;
+    header.num_relocations = writer.relocations_added;
+    memcpy(writer.data, &header, sizeof(header));
+
+    FILE* file = fopen(path, "wb");
+    int ok = file != NULL && fwrite(writer.data, writer.size, 1, file) == 1;
+    if (file != NULL && fclose(file) != 0) { ok = 0; }
+    engine_free(writer.data);
+    engine_free(writer.relocations);
+    engine_free(writer.textures);
+    engine_free(writer.texture_offsets);
+    return ok;
+}
+
+//Map a snapshot and relocate its pointers. Geometry stays in the mapping (copy on write, so edits stay
+//private to this process) and pages in as it is first drawn; only the per-frame arrays are allocated.
+//Returns NULL if the file is missing or doesn't match this build.
+World* load_snapshot(char* path, Uint32 user[4]) {
+    Uint8* base = NULL;
+    size_t size = 0;
+#ifdef __linux__
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return NULL; }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SnapshotHeader)) {
+        size = info.st_size;
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (memory != MAP_FAILED) { base = memory; }
+    }
+    close(fd);
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) { return NULL; }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length >= (long)sizeof(SnapshotHeader)) {
+        size = length;
+        base = engine_malloc(size, MEMORY_GEOMETRY);
+        if (fread(base, size, 1, file) != 1) { engine_free(base); base = NULL; }
+    }
+    fclose(file);
+#endif
+    if (base == NULL) { return NULL; }
+    init_morton_table(); //Textures in the snapshot are already swizzled, create_texture never runs for them
+
+    SnapshotHeader* header = (SnapshotHeader*)base;
+    int ok = header->magic == SNAPSHOT_MAGIC && header->version == SNAPSHOT_VERSION &&
+        header->pointer_size == sizeof(void*) && header->layout == snapshot_layout() && header->size == size &&
+        header->world <= size - sizeof(World) && header->relocations <= size &&
+        header->num_relocations <= (size - header->relocations)/sizeof(Uint64);
+    Uint64* relocations = (Uint64*)(base + header->relocations);
+    uintptr_t value;
+    size_t i;
+    for (i = 0; ok && i < header->num_relocations; i++) {
+        ok = relocations[i] <= size - sizeof(value);
+        if (!ok) { break; }
+        memcpy(&value, base + relocations[i], sizeof(value));
+        ok = value < size;
+        value += (uintptr_t)base;
+        memcpy(base + relocations[i], &value, sizeof(value));
+    }
+    if (!ok) {
+        printf("Bad snapshot file %s\n", path);
+        unmap_snapshot(base, size);
+        return NULL;
+    }
+
+    //The world and its two lists go on the heap so add_mesh and add_transform_node can still grow them
+    World* mapped = (World*)(base + header->world);
+    World* world = engine_malloc(sizeof(World), MEMORY_GEOMETRY);
+    *world = *mapped;
+    world->meshes = engine_malloc(sizeof(Mesh*)*world->num_meshes + 1, MEMORY_GEOMETRY);
+    memcpy(world->meshes, mapped->meshes, sizeof(Mesh*)*world->meshes_added);
+    world->graph.nodes = engine_malloc(sizeof(TransformNode)*world->graph.num_nodes + 1, MEMORY_GEOMETRY);
+    memcpy(world->graph.nodes, mapped->graph.nodes, sizeof(TransformNode)*world->graph.nodes_added);
+    world->lock = SDL_CreateMutex();
+    count_world(1);
+    world->snapshot = base;
+    world->snapshot_size = size;
+    int j;
+    for (j = 0; j < world->meshes_added; j++) {
+        Mesh* mesh = world->meshes[j];
+        mesh->mapping = base;
+        mesh->mapping_size = size;
+        mesh->vertices = engine_malloc(sizeof(Vertex)*mesh->vertices_added + 1, MEMORY_FRAME);
+        mesh->face_light = engine_malloc(sizeof(float)*mesh->polygons_added + 1, MEMORY_FRAME);
+        mesh->vertex_light = engine_malloc(sizeof(float)*mesh->vertices_added + 1, MEMORY_FRAME);
+    }
+    if (user != NULL) {
+        for (j = 0; j < 4; j++) { user[j] = header->user[j]; }
+    }
+    return world;
+}
+
+size_t mesh_bytes(Mesh* mesh) {
+    size_t bytes = sizeof(Mesh) + sizeof(Polygon*)*mesh->num_polygons;
+    bytes += sizeof(Vertex)*mesh->vertices_added + sizeof(Edge)*mesh->num_edges;
+    if (mesh->packed != NULL) {
+        bytes += sizeof(PackedVertex)*mesh->vertices_added;
+    } else {
+        bytes += sizeof(Vector3)*mesh->num_vertices;
+    }
+    bytes += sizeof(float)*(mesh->polygons_added + mesh->vertices_added); //Lighting cache
+    int i;
+    for (i = 0; i < mesh->polygons_added; i++) {
+        bytes += sizeof(Polygon) + (sizeof(int) + 2*sizeof(float))*mesh->polygons[i]->num_vertices;
+    }
+    return bytes;
+}
+
+//Chunk files are native endian: magic, mesh count, then per mesh its center, polygon count, and per
+//polygon the vertex count, RGBA color and x, y, z, u, v for each vertex.
+int save_chunk(char* path, Mesh** meshes, int num_meshes) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) { return 0; }
+    Uint32 magic = CHUNK_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, file);
+    fwrite(&num_meshes, sizeof(int), 1, file);
+    int i, j, k;
+    Mesh* mesh;
+    Polygon* poly;
+    for (i = 0; i < num_meshes; i++) {
+        mesh = meshes[i];
+        fwrite(&(mesh->center), sizeof(Vector3), 1, file);
+        fwrite(&(mesh->polygons_added), sizeof(int), 1, file);
+        for (j = 0; j < mesh->polygons_added; j++) {
+            poly = mesh->polygons[j];
+            fwrite(&(poly->vertices_added), sizeof(int), 1, file);
+            fwrite(&(poly->color), sizeof(SDL_Color), 1, file);
+            for (k = 0; k < poly->vertices_added; k++) {
+                Vector3 position = mesh_position(mesh, poly->indices[k]);
+                fwrite(&position, sizeof(Vector3), 1, file);
+                fwrite(poly->uvs + 2*k, sizeof(float), 2, file);
+            }
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+//Runs on the I/O thread. A missing file is an empty cell, not an error.
+void load_chunk(ChunkStreamer* streamer, Chunk* chunk) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/chunk_%d_%d.bin", streamer->directory, chunk->cx, chunk->cz);
+    chunk->meshes = NULL;
+    chunk->num_meshes = 0;
+    chunk->bytes = 0;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) { return; }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    Uint32 magic = 0;
+    int num_meshes = 0;
+    //Counts are checked against what is left of the file before anything is allocated for them:
+    //a mesh needs at least its center and polygon count, a polygon its vertex count and color
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != CHUNK_MAGIC ||
+        fread(&num_meshes, sizeof(int), 1, file) != 1 || num_meshes < 0 ||
+        (size_t)num_meshes > (size - ftell(file))/(sizeof(Vector3) + sizeof(int))) {
+        printf("Bad chunk file %s\n", path);
+        fclose(file);
+        return;
+    }
+    chunk->meshes = engine_malloc(sizeof(Mesh*)*num_meshes + 1, MEMORY_GEOMETRY);
+    int i, j, k, ok = 1;
+    int num_polygons, num_vertices;
+    Vector3 center, pos;
+    SDL_Color color;
+    float uv[2];
+    Mesh* mesh = NULL;
+    Polygon* poly = NULL;
+    for (i = 0; i < num_meshes && ok; i++) {
+        ok = fread(&center, sizeof(Vector3), 1, file) == 1 && fread(&num_polygons, sizeof(int), 1, file) == 1 &&
+            num_polygons >= 0 && (size_t)num_polygons <= (size - ftell(file))/(sizeof(int) + sizeof(SDL_Color));
+        if (!ok) { break; }
+        mesh = create_mesh(num_polygons);
+        mesh->center = center;
+        for (j = 0; j < num_polygons && ok; j++) {
+            ok = fread(&num_vertices, sizeof(int), 1, file) == 1 && fread(&color, sizeof(SDL_Color), 1, file) == 1 &&
+                num_vertices >= 0 && (size_t)num_vertices <= (size - ftell(file))/(sizeof(Vector3) + 2*sizeof(float));
+            if (!ok) { break; }
+            poly = create_polygon(num_vertices, &color);
+            for (k = 0; k < num_vertices && ok; k++) {
+                ok = fread(&pos, sizeof(Vector3), 1, file) == 1 && fread(uv, sizeof(float), 2, file) == 2;
+                if (ok) { push_vertex_uv(poly, pos.x, pos.y, pos.z, uv[0], uv[1]); }
+            }
+            if (!ok) { break; }
+            add_polygon(mesh, poly);
+            poly = NULL;
+        }
+        if (!ok) { break; }
+        optimize_mesh(mesh, NULL, NULL);
+        compress_mesh(mesh); //Streamed geometry is static, keep it in the compact format
+        chunk->meshes[chunk->num_meshes] = mesh;
+        chunk->num_meshes += 1;
+        chunk->bytes += mesh_bytes(mesh);
+        mesh = NULL;
+    }
+    fclose(file);
+    if (!ok) {
+        //Nothing from a damaged file is published, half a mesh would render garbage
+        printf("Truncated chunk file %s\n", path);
+        if (poly != NULL) { free_polygon(poly); }
+        if (mesh != NULL) { free_mesh(mesh); }
+        for (i = 0; i < chunk->num_meshes; i++) {
+            free_mesh(chunk->meshes[i]);
+        }
+        engine_free(chunk->meshes);
+        chunk->meshes = NULL;
+        chunk->num_meshes = 0;
+        chunk->bytes = 0;
+    }
+}
+
+int chunk_io_thread(void* data) {
+    ChunkStreamer* streamer = data;
+    Chunk* chunk;
+    SDL_LockMutex(streamer->lock);
+    while (!streamer->quit) {
+        if (streamer->num_requests == 0 || streamer->num_completed == MAX_PENDING_CHUNKS) {
+            SDL_CondWait(streamer->wake, streamer->lock);
+            continue;
+        }
+        chunk = streamer->requests[0];
+        streamer->num_requests -= 1;
+        memmove(streamer->requests, streamer->requests + 1, sizeof(Chunk*)*streamer->num_requests);
+        SDL_UnlockMutex(streamer->lock);
+
+        load_chunk(streamer, chunk); //Disk and allocation happen outside the lock
+
+        SDL_LockMutex(streamer->lock);
+        chunk->state = CHUNK_READY;
+        streamer->completed[streamer->num_completed] = chunk;
+        streamer->num_completed += 1;
+    }
+    SDL_UnlockMutex(streamer->lock);
+    return 0;
+}
+
+ChunkStreamer* create_chunk_streamer(char* directory, size_t budget) {
+    ChunkStreamer* streamer = engine_malloc(sizeof(ChunkStreamer), MEMORY_GEOMETRY);
+    streamer->directory = directory;
+    streamer->budget = budget;
+    streamer->resident_bytes = 0;
+    streamer->num_chunks = 64;
+    streamer->chunks = engine_malloc(sizeof(Chunk*)*streamer->num_chunks, MEMORY_GEOMETRY);
+    streamer->chunks_added = 0;
+    streamer->lock = SDL_CreateMutex();
+    streamer->wake = SDL_CreateCond();
+    streamer->num_requests = 0;
+    streamer->num_completed = 0;
+    streamer->quit = 0;
+    streamer->thread = SDL_CreateThread(chunk_io_thread, "chunk io", streamer);
+    return streamer;
+}
+
+//Drop a chunk the render thread owns, taking its meshes out of the world first
+void evict_chunk(ChunkStreamer* streamer, World* world, int index) {
+    Chunk* chunk = streamer->chunks[index];
+    int i;
+    if (chunk->state == CHUNK_RESIDENT) {
+        for (i = 0; i < chunk->num_meshes; i++) {
+            remove_mesh(world, chunk->meshes[i]);
+        }
+        //A ray query that listed these meshes before they came out may still be reading them. Later ones
+        //won't list them: cast_ray builds its list under world->lock, which is held around update_streaming.
+        while (SDL_AtomicGet(&(world->ray_readers)) > 0) { SDL_Delay(0); }
+    }
+    for (i = 0; i < chunk->num_meshes; i++) {
+        free_mesh(chunk->meshes[i]);
+    }
+    if (chunk->state == CHUNK_RESIDENT) {
+        streamer->resident_bytes -= chunk->bytes;
+    }
+    engine_free(chunk->meshes);
+    engine_free(chunk);
+    streamer->chunks[index] = streamer->chunks[streamer->chunks_added - 1];
+    streamer->chunks_added -= 1;
 }
 
-//Add mesh to world
-void add_mesh(World* world, Mesh* mesh) {
-    world->meshes[world->meshes_added] = mesh;
-    world->meshes_added += 1;
+int chunk_distance(Chunk* chunk, int cx, int cz) {
+    int dx = abs(chunk->cx - cx);
+    int dz = abs(chunk->cz - cz);
+    return dx > dz ? dx : dz;
 }
 
-//Render a polygon
-void render_polygon(SDL_Renderer* renderer, Polygon* polygon, Vector3* translation) { //Add translations here
-    //Shading happens here
-    //Fill then outline. We'll use white outlines for debugging now.
-    int num_edges = polygon->num_vertices;
-    int yMax = -32767;
-    int yMin = 32767;
-    int xMax = -32767;
-    int xMin = 32767;
-
-    int edges[num_edges][2]; //array of [x1, y1, x2, y2] arrays
-    int i = 0;
-    int pointX; int pointY;
-    while (i < num_edges) {
-        pointX = x2d(&(polygon->sequence[i].perspective), translation); 
-        pointY = y2d(&(polygon->sequence[i].perspective), translation); 
-        if (pointY > yMax) { yMax = pointY; }
-        if (pointY < yMin) { yMin = pointY; }
-        if (pointX > xMax) { xMax = pointX; }
-        if (pointX < xMin) { xMin = pointX; }
-        edges[i][0] = pointX;
-        edges[i][1] = pointY;
-        if (i == num_edges - 1) {
-            edges[i][2] = edges[0][0]; //If last vertex special case
-            edges[i][3] = edges[0][1];
-        } else {
-            edges[i][2] = edges[i+1][0];
-            edges[i][3] = edges[i+1][1];
-        }
-        i++;
-    }
-    int h = yMax-yMin;
-    RowBucket* row_buckets = malloc(sizeof(RowBucket)*h); //only need 2 assuming a convex polygon. boy this is easy with convex only, are we being too general by using this alg?
-    i = 0;
-    while (i < h) {
-        row_buckets[i].size = 0;
-        i++;
-    }
-    i = 0;
-    int x1, y1, x2, y2, m, x, y;
-    while (i < num_edges) {
-        if (edges[i][0] < edges[i][2]) {
-            x1 = edges[i][0];
-            y1 = edges[i][1];
-            x2 = edges[i][2];
-            y2 = edges[i][3];
-        } else {
-            x2 = edges[i][0];
-            y2 = edges[i][1];
-            x1 = edges[i][2];
-            y1 = edges[i][3];
+//Take a queued chunk back before the I/O thread picks it up. Returns 0 if it is already being loaded.
+int cancel_chunk_request(ChunkStreamer* streamer, Chunk* chunk) {
+    int i;
+    for (i = 0; i < streamer->num_requests; i++) {
+        if (streamer->requests[i] == chunk) {
+            streamer->num_requests -= 1;
+            memmove(streamer->requests + i, streamer->requests + i + 1, sizeof(Chunk*)*(streamer->num_requests - i));
+            return 1;
         }
-        if (x2-x1 == 0) {
-            //TODO: vert edge. will have to go up or down
-        } else {
-            m = (y2-y1)/(x2-x1);
-            if (m == 0) {
-                //TODO: horiz edge
-            } else {
-                for (x = x1; x < x2; x++) {
-                    y = m*(x-x1) + y1;
-                    y = y - yMin;
-                    //add x to row bucket with this y
-                    if (y >= 0 && y < h) {
-                        add_to_row_bucket(row_buckets+y, x);
-                    }
-                }
-            }
+    }
+    return 0;
+}
+
+//Called once per frame on the render thread. Never waits on the I/O thread: if the lock is busy
+//the handoff simply happens next frame.
+void update_streaming(ChunkStreamer* streamer, World* world, Vector3* rotation, Vector3* translation) {
+    Vector3 eye = camera_eye(*rotation, *translation);
+    int cx = (int)floor(eye.x/CHUNK_SIZE);
+    int cz = (int)floor(eye.z/CHUNK_SIZE);
+    int x, z, i, known;
+    if (SDL_TryLockMutex(streamer->lock) != 0) { return; }
+
+    for (i = 0; i < streamer->num_completed; i++) {
+        Chunk* chunk = streamer->completed[i];
+        int k;
+        for (k = 0; k < chunk->num_meshes; k++) {
+            add_mesh(world, chunk->meshes[k]);
         }
-        i++;
-    }
-    if (num_edges > 1) {
-        //fillerino
-        SDL_SetRenderDrawColor(renderer, polygon->color.r, polygon->color.g, polygon->color.b, SDL_ALPHA_OPAQUE);
-
-        //Go through each row-bucket (which contain edge points, set aside by shared y)
-        //Sort each row bucket
-        //We will have to add yMin to the result
-        i = 0;
-        int t, b;
-        int g, key, j;
-        int ub;
-        while (i < h) {
-            for (g = 1; g < row_buckets[i].size; g++) { 
-                //SORT YOLO
-                key = row_buckets[i].xvalues[g]; 
-                j = g-1; 
-            
-                /* Move elements of arr[0..i-1], that are 
-                    greater than key, to one position ahead 
-                    of their current position */
-                while (j >= 0 && row_buckets[i].xvalues[j] > key) 
-                { 
-                    row_buckets[i].xvalues[j+1] = row_buckets[i].xvalues[j]; 
-                    j = j-1; 
-                } 
-                row_buckets[i].xvalues[j+1] = key; 
+        chunk->state = CHUNK_RESIDENT;
+        streamer->resident_bytes += chunk->bytes;
+    }
+    streamer->num_completed = 0;
+
+    for (x = cx - CHUNK_RADIUS; x <= cx + CHUNK_RADIUS; x++) {
+        for (z = cz - CHUNK_RADIUS; z <= cz + CHUNK_RADIUS; z++) {
+            known = 0;
+            for (i = 0; i < streamer->chunks_added && !known; i++) {
+                known = streamer->chunks[i]->cx == x && streamer->chunks[i]->cz == z;
             }
-            
-            t = 0;
-            b = 1;
-            while (t < row_buckets[i].size) {
-                if (1 || b == 1) {
-                    if (t < row_buckets[i].size-1) {
-                        ub = row_buckets[i].xvalues[t+1];
-                        SDL_RenderDrawLine(renderer, row_buckets[i].xvalues[t], yMin + i, ub, yMin + i);
-                    }
-                    b = 0;
-                } else {
-                    b = 1;
-                }
-                t++;
+            if (known || streamer->num_requests == MAX_PENDING_CHUNKS) { continue; }
+            Chunk* chunk = engine_malloc(sizeof(Chunk), MEMORY_GEOMETRY);
+            chunk->cx = x;
+            chunk->cz = z;
+            chunk->state = CHUNK_QUEUED;
+            chunk->meshes = NULL;
+            chunk->num_meshes = 0;
+            chunk->bytes = 0;
+            if (streamer->chunks_added == streamer->num_chunks) {
+                streamer->num_chunks *= 2;
+                streamer->chunks = engine_realloc(streamer->chunks, sizeof(Chunk*)*streamer->num_chunks, MEMORY_GEOMETRY);
             }
-            i++;
+            streamer->chunks[streamer->chunks_added] = chunk;
+            streamer->chunks_added += 1;
+            streamer->requests[streamer->num_requests] = chunk;
+            streamer->num_requests += 1;
         }
     }
 
-    //outline in white
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE);
-    i = 0;
-    while (i < num_edges) {
-        SDL_RenderDrawLine(renderer, edges[i][0], edges[i][1], edges[i][2], edges[i][3]);
-        i++;
-    }
-    free(row_buckets);
-}
-
-//Render each of a mesh's polygons
-void render_mesh(SDL_Renderer* renderer, Mesh* mesh, Vector3* translation) {
-    Polygon** p = mesh->polygons;
-    int i = 0;
-    while (i < mesh->num_polygons) {
-        //Render polygons in order.
-        render_polygon(renderer, *p, translation); //is pointer to a polygon
-        p++; i++;
+    //Far cells go whatever the budget, so the chunk list and the scan above stay bounded as the camera
+    //travels. Empty cells cost nothing to find again. Backwards because evict_chunk moves the last one in.
+    for (i = streamer->chunks_added - 1; i >= 0; i--) {
+        Chunk* chunk = streamer->chunks[i];
+        int d = chunk_distance(chunk, cx, cz);
+        if (d <= CHUNK_RADIUS) { continue; }
+        if (chunk->state == CHUNK_RESIDENT && (chunk->num_meshes == 0 || d > CHUNK_KEEP_RADIUS)) {
+            evict_chunk(streamer, world, i);
+        } else if (chunk->state == CHUNK_QUEUED && cancel_chunk_request(streamer, chunk)) {
+            evict_chunk(streamer, world, i);
+        }
     }
-}
 
-//Render each mesh in a world
-void render_world(SDL_Renderer* renderer, World* world, Vector3* translation) {
-    Mesh** p = world->meshes;
-    int i = 0;
-    while (i < world->meshes_added) {
-        //Render meshes in order.
-        //if (*p == NULL) { break; }
-        if ((*p)->re_render == 1) {     
-            render_mesh(renderer, *p, translation);
-            (*p)->re_render = 0;
+    //Over budget: evict the farthest resident chunks, but never one the camera still needs
+    while (streamer->resident_bytes > streamer->budget) {
+        int farthest = -1;
+        int farthest_distance = CHUNK_RADIUS;
+        for (i = 0; i < streamer->chunks_added; i++) {
+            if (streamer->chunks[i]->state != CHUNK_RESIDENT) { continue; }
+            int d = chunk_distance(streamer->chunks[i], cx, cz);
+            if (d > farthest_distance) {
+                farthest = i;
+                farthest_distance = d;
+            }
         }
-        i++; p++;
+        if (farthest < 0) { break; } //Everything left is in range, the budget is too small for CHUNK_RADIUS
+        evict_chunk(streamer, world, farthest);
     }
+    SDL_CondSignal(streamer->wake);
+    SDL_UnlockMutex(streamer->lock); //Held throughout, the I/O thread writes chunk states under it
 }
 
-void free_world(World* world) {
-    int i, j;
-    for (i = 0; i < world->meshes_added; i++) {
-        for (j = 0; j < world->meshes[i]->polygons_added; j++) {
-            free(world->meshes[i]->polygons[j]);
-        }
-        free(world->meshes[i]);
+//Stops the I/O thread, then frees every chunk. Resident meshes are taken out of the world first.
+void free_chunk_streamer(ChunkStreamer* streamer, World* world) {
+    SDL_LockMutex(streamer->lock);
+    streamer->quit = 1;
+    SDL_CondSignal(streamer->wake);
+    SDL_UnlockMutex(streamer->lock);
+    SDL_WaitThread(streamer->thread, NULL);
+    while (streamer->chunks_added > 0) {
+        evict_chunk(streamer, world, streamer->chunks_added - 1);
     }
-    free(world);
-    print("Freed world");
+    SDL_DestroyCond(streamer->wake);
+    SDL_DestroyMutex(streamer->lock);
+    engine_free(streamer->chunks);
+    engine_free(streamer);
 }
 
 Mesh* create_cube_mesh(int x, int y, int z, int w, int h, int l, SDL_Color* color) {
@@ -411,40 +3274,40 @@ Mesh* create_cube_mesh(int x, int y, int z, int w, int h, int l, SDL_Color* colo
     int back = z - l/2;
 
     Polygon* polygon1 = create_polygon(4, color);
-    push_vertex(polygon1, left, top, front);
-    push_vertex(polygon1, right, top, front);
-    push_vertex(polygon1, right, bot, front);
-    push_vertex(polygon1, left, bot, front);
+    push_vertex_uv(polygon1, left, top, front, 0, 0);
+    push_vertex_uv(polygon1, right, top, front, 1, 0);
+    push_vertex_uv(polygon1, right, bot, front, 1, 1);
+    push_vertex_uv(polygon1, left, bot, front, 0, 1);
 
     Polygon* polygon2 = create_polygon(4, color);
-    push_vertex(polygon2, left, top, back);
-    push_vertex(polygon2, right, top, back);
-    push_vertex(polygon2, right, bot, back);
-    push_vertex(polygon2, left, bot, back);
+    push_vertex_uv(polygon2, left, top, back, 0, 0);
+    push_vertex_uv(polygon2, right, top, back, 1, 0);
+    push_vertex_uv(polygon2, right, bot, back, 1, 1);
+    push_vertex_uv(polygon2, left, bot, back, 0, 1);
 
     Polygon* polygon3 = create_polygon(4, color);
-    push_vertex(polygon3, left, top, front);
-    push_vertex(polygon3, left, top, back);
-    push_vertex(polygon3, left, bot, back);
-    push_vertex(polygon3, left, bot, front);
+    push_vertex_uv(polygon3, left, top, front, 0, 0);
+    push_vertex_uv(polygon3, left, top, back, 1, 0);
+    push_vertex_uv(polygon3, left, bot, back, 1, 1);
+    push_vertex_uv(polygon3, left, bot, front, 0, 1);
 
     Polygon* polygon4 = create_polygon(4, color);
-    push_vertex(polygon4, right, top, front);
-    push_vertex(polygon4, right, top, back);
-    push_vertex(polygon4, right, bot, back);
-    push_vertex(polygon4, right, bot, front);
+    push_vertex_uv(polygon4, right, top, front, 0, 0);
+    push_vertex_uv(polygon4, right, top, back, 1, 0);
+    push_vertex_uv(polygon4, right, bot, back, 1, 1);
+    push_vertex_uv(polygon4, right, bot, front, 0, 1);
 
     Polygon* polygon5 = create_polygon(4, color);
-    push_vertex(polygon5, left, top, front);
-    push_vertex(polygon5, left, top, back);
-    push_vertex(polygon5, right, top, back);
-    push_vertex(polygon5, right, top, front);
+    push_vertex_uv(polygon5, left, top, front, 0, 0);
+    push_vertex_uv(polygon5, left, top, back, 1, 0);
+    push_vertex_uv(polygon5, right, top, back, 1, 1);
+    push_vertex_uv(polygon5, right, top, front, 0, 1);
 
     Polygon* polygon6 = create_polygon(4, color);
-    push_vertex(polygon6, left, bot, front);
-    push_vertex(polygon6, left, bot, back);
-    push_vertex(polygon6, right, bot, back);
-    push_vertex(polygon6, right, bot, front);
+    push_vertex_uv(polygon6, left, bot, front, 0, 0);
+    push_vertex_uv(polygon6, left, bot, back, 1, 0);
+    push_vertex_uv(polygon6, right, bot, back, 1, 1);
+    push_vertex_uv(polygon6, right, bot, front, 0, 1);
 
     Mesh* cube = create_mesh(6);
     cube->center.x = x;
@@ -460,8 +3323,16 @@ Mesh* create_cube_mesh(int x, int y, int z, int w, int h, int l, SDL_Color* colo
     return cube;
 }
 
+//Texture every polygon of a mesh, the texture stays owned by the caller
+void set_mesh_texture(Mesh* mesh, Texture* texture) {
+    int i;
+    for (i = 0; i < mesh->polygons_added; i++) {
+        mesh->polygons[i]->texture = texture;
+    }
+}
+
 Mesh* create_axes_mesh() {
-    SDL_Color color = { 255, 255, 255 };
+    SDL_Color color = { 255, 255, 255, 255 };
     Polygon* x_axis = create_polygon(2, &color);
     push_vertex(x_axis, 0, 0, 0);
     push_vertex(x_axis, 300, 0, 0);
@@ -480,11 +3351,735 @@ Mesh* create_axes_mesh() {
     return axes;
 }
 
+//A grid of city blocks for trying out streaming: radius cells in every direction from the origin
+void write_demo_chunks(char* directory, int radius) {
+    char path[1024];
+    int cx, cz, i, j;
+    Mesh* meshes[16];
+    srand(1);
+    for (cx = -radius; cx <= radius; cx++) {
+        for (cz = -radius; cz <= radius; cz++) {
+            for (i = 0; i < 4; i++) {
+                for (j = 0; j < 4; j++) {
+                    SDL_Color color = { 80 + rand()%150, 80 + rand()%150, 80 + rand()%150, 255 };
+                    int h = 100 + rand()%900;
+                    int x = cx*CHUNK_SIZE + CHUNK_SIZE/8 + i*CHUNK_SIZE/4;
+                    int z = cz*CHUNK_SIZE + CHUNK_SIZE/8 + j*CHUNK_SIZE/4;
+                    meshes[4*i + j] = create_cube_mesh(x, h/2 - 500, z, CHUNK_SIZE/6, h, CHUNK_SIZE/6, &color);
+                    build_mesh(meshes[4*i + j]);
+                }
+            }
+            snprintf(path, sizeof(path), "%s/chunk_%d_%d.bin", directory, cx, cz);
+            if (!save_chunk(path, meshes, 16)) {
+                printf("Could not write %s\n", path);
+            }
+            for (i = 0; i < 16; i++) {
+                free_mesh(meshes[i]);
+            }
+        }
+    }
+}
+
+//Ring of num_slots frames the size of fb, in a memfd when the platform has one so another process
+//can map it through /proc/<pid>/fd/<fd>
+CaptureRing* create_capture_ring(Framebuffer* fb, int num_slots) {
+    CaptureRing* ring = engine_malloc(sizeof(CaptureRing), MEMORY_OTHER);
+    size_t stride = sizeof(Uint32)*fb->width;
+    size_t slot_bytes = (CAPTURE_SLOT_HEADER + stride*fb->height + 4095) & ~(size_t)4095; //Page aligned slots
+    ring->size = CAPTURE_DATA_OFFSET + slot_bytes*num_slots;
+    ring->fd = -1;
+    ring->header = NULL;
+#ifdef __linux__
+    ring->fd = memfd_create("engine capture", MFD_CLOEXEC);
+    if (ring->fd >= 0) {
+        void* memory = MAP_FAILED;
+        if (ftruncate(ring->fd, ring->size) == 0) {
+            memory = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+        }
+        if (memory == MAP_FAILED) {
+            close(ring->fd);
+            ring->fd = -1;
+        } else {
+            ring->header = memory;
+        }
+    }
+#endif
+    if (ring->header == NULL) { //In process consumers only
+        ring->header = engine_calloc(1, ring->size, MEMORY_FRAME);
+    }
+    CaptureHeader* header = ring->header;
+    header->magic = CAPTURE_MAGIC;
+    header->width = fb->width;
+    header->height = fb->height;
+    header->stride = stride;
+    header->num_slots = num_slots;
+    header->slot_bytes = slot_bytes;
+    header->data_offset = CAPTURE_DATA_OFFSET;
+    SDL_AtomicSet(&(header->write_sequence), 0);
+    SDL_AtomicSet(&(header->read_sequence), 0);
+    SDL_AtomicSet(&(header->dropped), 0);
+    ring->own_pixels = fb->pixels;
+    ring->acquired = -1;
+    ring->frame = 0;
+    return ring;
+}
+
+CaptureSlot* capture_slot(CaptureRing* ring, int index) {
+    return (CaptureSlot*)((char*)ring->header + ring->header->data_offset + (size_t)ring->header->slot_bytes*index);
+}
+
+//Frames published but not yet released by the consumer
+int capture_backlog(CaptureRing* ring) {
+    return SDL_AtomicGet(&(ring->header->write_sequence)) - SDL_AtomicGet(&(ring->header->read_sequence));
+}
+
+//Point fb at the next free slot before drawing. The engine never waits on the consumer: with the ring
+//full the frame goes to the framebuffer's own pixels instead and is counted as dropped.
+void capture_acquire(CaptureRing* ring, Framebuffer* fb) {
+    CaptureHeader* header = ring->header;
+    if (capture_backlog(ring) >= (int)header->num_slots) {
+        SDL_AtomicAdd(&(header->dropped), 1);
+        ring->acquired = -1;
+        fb->pixels = ring->own_pixels;
+        return;
+    }
+    ring->acquired = SDL_AtomicGet(&(header->write_sequence)) % header->num_slots;
+    fb->pixels = (Uint32*)((char*)capture_slot(ring, ring->acquired) + CAPTURE_SLOT_HEADER);
+}
+
+//Hand the finished frame to the consumer, after the last read of fb->pixels on our side
+void capture_publish(CaptureRing* ring) {
+    if (ring->acquired >= 0) {
+        CaptureSlot* slot = capture_slot(ring, ring->acquired);
+        slot->frame = ring->frame;
+        slot->ticks = SDL_GetTicks();
+        SDL_AtomicAdd(&(ring->header->write_sequence), 1); //Full barrier, the pixels are visible before the count
+    }
+    ring->acquired = -1;
+    ring->frame += 1;
+}
+
+void free_capture_ring(CaptureRing* ring, Framebuffer* fb) {
+    fb->pixels = ring->own_pixels;
+#ifdef __linux__
+    if (ring->fd >= 0) {
+        munmap(ring->header, ring->size);
+        close(ring->fd);
+        engine_free(ring);
+        return;
+    }
+#endif
+    engine_free(ring->header);
+    engine_free(ring);
+}
+
+Overlay* create_overlay() {
+    Overlay* overlay = engine_malloc(sizeof(Overlay), MEMORY_HUD);
+    overlay->num_elements = 8;
+    overlay->elements = engine_malloc(sizeof(OverlayElement*)*overlay->num_elements, MEMORY_HUD);
+    overlay->elements_added = 0;
+    return overlay;
+}
+
+OverlayElement* add_overlay_element(Overlay* overlay, int x, int y, int width, int height, OverlayDrawFunction draw, void* data) {
+    OverlayElement* element = engine_malloc(sizeof(OverlayElement), MEMORY_HUD);
+    element->x = x;
+    element->y = y;
+    element->width = width;
+    element->height = height;
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+    element->pixels = engine_calloc(height, stride, MEMORY_HUD);
+    element->surface = cairo_image_surface_create_for_data(element->pixels, CAIRO_FORMAT_ARGB32, width, height, stride);
+    element->draw = draw;
+    element->data = data;
+    element->text[0] = 0;
+    element->font_size = 20;
+    element->color[0] = 1; element->color[1] = 1; element->color[2] = 1;
+    element->dirty = 1;
+    element->visible = 1;
+    element->redraws = 0;
+    if (overlay->elements_added == overlay->num_elements) {
+        overlay->num_elements *= 2;
+        overlay->elements = engine_realloc(overlay->elements, sizeof(OverlayElement*)*overlay->num_elements, MEMORY_HUD);
+    }
+    overlay->elements[overlay->elements_added] = element;
+    overlay->elements_added += 1;
+    return element;
+}
+
+void draw_overlay_label(cairo_t* cr, OverlayElement* element) {
+    cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, element->font_size);
+    cairo_set_source_rgb(cr, element->color[0], element->color[1], element->color[2]);
+    cairo_move_to(cr, 0, element->font_size);
+    cairo_show_text(cr, element->text);
+}
+
+OverlayElement* add_overlay_label(Overlay* overlay, int x, int y, int width, double font_size, char* text) {
+    OverlayElement* element = add_overlay_element(overlay, x, y, width, (int)ceil(font_size*1.4), draw_overlay_label, NULL);
+    element->font_size = font_size;
+    snprintf(element->text, sizeof(element->text), "%s", text);
+    return element;
+}
+
+//Only an actual change of text costs a redraw
+void set_overlay_text(OverlayElement* element, char* text) {
+    if (strncmp(element->text, text, sizeof(element->text) - 1) == 0) { return; }
+    snprintf(element->text, sizeof(element->text), "%s", text);
+    element->dirty = 1;
+}
+
+void redraw_overlay_element(OverlayElement* element) {
+    cairo_t* cr = cairo_create(element->surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    element->draw(cr, element);
+    if (cairo_status(cr)) {
+        printf("Cairo is unhappy: %s\n", cairo_status_to_string(cairo_status(cr)));
+    }
+    cairo_destroy(cr);
+    cairo_surface_flush(element->surface);
+    element->dirty = 0;
+    element->redraws += 1;
+}
+
+//dst = src + dst*(1 - src alpha) for premultiplied src, four pixels at a time with SSE2.
+//Fully transparent groups of four are skipped, which is most of a typical HUD surface.
+void composite_span(Uint32* dst, Uint32* src, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i full = _mm_set1_epi16(256);
+    __m128i opaque = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((__m128i*)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(s, 24), zero)) == 0xffff) { continue; }
+        __m128i d = _mm_loadu_si128((__m128i*)(dst + i));
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        //Per pixel alpha in every channel, 255 bumped to 256 like blend_span
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        a_lo = _mm_add_epi16(a_lo, _mm_srli_epi16(a_lo, 7));
+        a_hi = _mm_add_epi16(a_hi, _mm_srli_epi16(a_hi, 7));
+        __m128i d_lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, a_lo)), 8);
+        __m128i d_hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, a_hi)), 8);
+        __m128i out = _mm_packus_epi16(_mm_add_epi16(s_lo, d_lo), _mm_add_epi16(s_hi, d_hi));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(out, opaque));
+    }
+#endif
+    Uint32 s, d, a;
+    for (; i < n; i++) {
+        s = src[i];
+        a = s >> 24;
+        if (a == 0) { continue; }
+        a += a >> 7;
+        d = dst[i];
+        dst[i] = 0xff000000 |
+            ((((s >> 16) & 255) + ((((d >> 16) & 255)*(256 - a)) >> 8)) << 16) |
+            ((((s >> 8) & 255) + ((((d >> 8) & 255)*(256 - a)) >> 8)) << 8) |
+            ((s & 255) + (((d & 255)*(256 - a)) >> 8));
+    }
+}
+
+//Redraw whatever changed, then composite every visible element over the 3D frame
+void composite_overlay(Overlay* overlay, Framebuffer* fb) {
+    int i, row;
+    OverlayElement* element;
+    for (i = 0; i < overlay->elements_added; i++) {
+        element = overlay->elements[i];
+        if (!element->visible) { continue; }
+        if (element->dirty) {
+            redraw_overlay_element(element);
+        }
+        Uint8* data = cairo_image_surface_get_data(element->surface);
+        int stride = cairo_image_surface_get_stride(element->surface);
+        int x0 = element->x < 0 ? 0 : element->x;
+        int x1 = element->x + element->width > fb->width ? fb->width : element->x + element->width;
+        int y0 = element->y < 0 ? 0 : element->y;
+        int y1 = element->y + element->height > fb->height ? fb->height : element->y + element->height;
+        if (x0 >= x1) { continue; }
+        for (row = y0; row < y1; row++) {
+            Uint32* src = (Uint32*)(data + (size_t)stride*(row - element->y)) + (x0 - element->x);
+            composite_span(fb->pixels + row*fb->width + x0, src, x1 - x0);
+        }
+    }
+}
+
+void free_overlay(Overlay* overlay) {
+    int i;
+    for (i = 0; i < overlay->elements_added; i++) {
+        cairo_surface_destroy(overlay->elements[i]->surface);
+        engine_free(overlay->elements[i]->pixels);
+        engine_free(overlay->elements[i]);
+    }
+    engine_free(overlay->elements);
+    engine_free(overlay);
+}
+
+//Dashed cross at the middle of the screen, drawn once and cached for good
+void draw_crosshair(cairo_t* cr, OverlayElement* element) {
+    double dash[2] = { 4, 4 };
+    double cx = element->width/2.0, cy = element->height/2.0;
+    cairo_set_source_rgba(cr, element->color[0], element->color[1], element->color[2], 0.8);
+    cairo_set_line_width(cr, 2);
+    cairo_set_dash(cr, dash, 2, 0);
+    cairo_move_to(cr, 0, cy);
+    cairo_line_to(cr, element->width, cy);
+    cairo_move_to(cr, cx, 0);
+    cairo_line_to(cr, cx, element->height);
+    cairo_stroke(cr);
+    cairo_set_dash(cr, NULL, 0, 0);
+    cairo_arc(cr, cx, cy, element->width/6.0, 0, 2*M_PI);
+    cairo_stroke(cr);
+}
+
+void record_latency(LatencyHistogram* histogram, Uint32 ms) {
+    histogram->counts[ms < LATENCY_BUCKETS ? ms : LATENCY_BUCKETS - 1] += 1;
+    histogram->samples += 1;
+    histogram->total += ms;
+    if (ms > histogram->max) { histogram->max = ms; }
+}
+
+//Smallest latency at or above fraction p of the samples, in whole ms
+Uint32 latency_percentile(LatencyHistogram* histogram, double p) {
+    int i, seen = 0;
+    int target = (int)ceil(p*histogram->samples);
+    if (target < 1) { target = 1; }
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target) { return i; }
+    }
+    return histogram->max;
+}
+
+void print_latency(LatencyHistogram* histogram) {
+    if (histogram->samples == 0) {
+        print("No input latency samples");
+        return;
+    }
+    printf("Input to present latency, %d samples: mean %.1f ms, p50 %u, p95 %u, p99 %u, max %u\n",
+           histogram->samples, histogram->total/histogram->samples, latency_percentile(histogram, 0.5),
+           latency_percentile(histogram, 0.95), latency_percentile(histogram, 0.99), histogram->max);
+    int i, most = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (histogram->counts[i] > most) { most = histogram->counts[i]; }
+    }
+    char bar[51];
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) { continue; }
+        int length = histogram->counts[i]*50/most;
+        memset(bar, '#', length);
+        bar[length] = 0;
+        printf("%3d%s ms %6d %s\n", i, i == LATENCY_BUCKETS - 1 ? "+" : " ", histogram->counts[i], bar);
+    }
+}
+
+DemoScene* create_demo_scene(int report) {
+    SDL_Color white = { 255, 255, 255, 255 };
+    SDL_Color glass = { 120, 180, 255, 110 };
+    SDL_Color grey = { 90, 90, 90, 255 };
+    DemoScene* scene = engine_malloc(sizeof(DemoScene), MEMORY_OTHER);
+
+    Mesh* axes = create_axes_mesh();
+
+    Mesh* cube = create_cube_mesh(100, 100, 100, 400, 100, 100, &white);
+    Mesh* cube1 = create_cube_mesh(200, 100, 100, 100, 400, 100, &white);
+    Mesh* cube2 = create_cube_mesh(200, 100, 100, 100, 100, 400, &white);
+    Mesh* cube3 = create_cube_mesh(100, 300, 100, 400, 100, 100, &white);
+    Mesh* cube4 = create_cube_mesh(200, 300, 100, 100, 400, 100, &white);
+    Mesh* cube5 = create_cube_mesh(200, 300, 100, 100, 100, 400, &white);
+    Mesh* pane = create_cube_mesh(-100, 0, -150, 500, 600, 20, &glass); //In front of the shape
+
+    World* world = create_world(7);
+    add_mesh(world, axes);
+    add_mesh(world, cube);
+    add_mesh(world, cube1);
+    add_mesh(world, cube2);
+    add_mesh(world, cube3);
+    add_mesh(world, cube4);
+    add_mesh(world, cube5);
+    add_mesh(world, pane);
+    optimize_world(world, report);
+
+    //The six cubes are one shape, they turn together about its middle
+    int shape = add_transform_node(&(world->graph), -1);
+    Vector3 shape_pivot; shape_pivot.x = 150; shape_pivot.y = 200; shape_pivot.z = 100;
+    world->graph.nodes[shape].pivot = shape_pivot;
+    attach_mesh(cube, shape);
+    attach_mesh(cube1, shape);
+    attach_mesh(cube2, shape);
+    attach_mesh(cube3, shape);
+    attach_mesh(cube4, shape);
+    attach_mesh(cube5, shape);
+
+    add_light(world, LIGHT_DIRECTIONAL, -0.5, -1, 0.7, 0.8);
+
+    scene->checker = create_checker_texture(256, 8, &white, &grey);
+    set_mesh_texture(cube1, scene->checker);
+
+    scene->world = world;
+    scene->shape = shape;
+    scene->spinner = cube1;
+    return scene;
+}
+
+//Pose the scene's animation at a frame number, so any frame can be rendered without the ones before it
+void animate_demo_scene(DemoScene* scene, int frame) {
+    scene->spinner->rotation.x = 0.0001*frame;
+    scene->spinner->rotation.y = 0.0001*frame;
+    scene->spinner->rotation.z = 0.0001*frame;
+    Vector3 shape_rotation;
+    shape_rotation.x = 0;
+    shape_rotation.y = 0.00005*frame;
+    shape_rotation.z = 0;
+    set_node_rotation(&(scene->world->graph), scene->shape, shape_rotation);
+}
+
+void free_demo_scene(DemoScene* scene) {
+    free_world(scene->world);
+    if (scene->checker != NULL) { free_texture(scene->checker); }
+    engine_free(scene);
+}
+
+//Load the demo scene from a snapshot, or build it and write the snapshot for next time.
+//With no path it is just built. report 0 keeps it quiet, for batch workers after the first.
+DemoScene* open_demo_scene(char* snapshot_path, int report) {
+    Uint32 user[4];
+    DemoScene* scene;
+    if (snapshot_path != NULL) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        World* world = load_snapshot(snapshot_path, user);
+        if (world != NULL && (int)user[0] < world->meshes_added && (int)user[1] < world->graph.nodes_added) {
+            scene = engine_malloc(sizeof(DemoScene), MEMORY_OTHER);
+            scene->world = world;
+            scene->spinner = world->meshes[user[0]];
+            scene->shape = user[1];
+            scene->checker = NULL; //Lives in the snapshot
+            if (report) { printf("Loaded %s in %.2f ms\n", snapshot_path, (double)(SDL_GetPerformanceCounter() - start)*1000/SDL_GetPerformanceFrequency()); }
+            return scene;
+        }
+        if (world != NULL) { free_world(world); }
+    }
+    scene = create_demo_scene(report);
+    if (snapshot_path != NULL) {
+        int i;
+        for (i = 0; i < scene->world->meshes_added; i++) {
+            if (scene->world->meshes[i] == scene->spinner) { user[0] = i; }
+        }
+        user[1] = scene->shape;
+        user[2] = 0;
+        user[3] = 0;
+        if (save_snapshot(snapshot_path, scene->world, user)) {
+            printf("Saved snapshot %s\n", snapshot_path);
+        } else {
+            printf("Could not write snapshot %s\n", snapshot_path);
+        }
+    }
+    return scene;
+}
+
+int compare_camera_keys(const void* p1, const void* p2) {
+    return ((const CameraKey*)p1)->frame - ((const CameraKey*)p2)->frame;
+}
+
+//Camera path files have one key per line: frame tx ty tz rx ry rz. Blank lines and # comments are skipped.
+CameraPath* load_camera_path(char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) { return NULL; }
+    CameraPath* path = engine_malloc(sizeof(CameraPath), MEMORY_OTHER);
+    path->num_keys = 16;
+    path->keys = engine_malloc(sizeof(CameraKey)*path->num_keys, MEMORY_OTHER);
+    path->keys_added = 0;
+    char line[512];
+    int line_number = 0;
+    CameraKey key;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* start = line;
+        while (*start == ' ' || *start == '\t') { start++; }
+        if (*start == '#' || *start == '\n' || *start == '\r' || *start == 0) { continue; }
+        if (sscanf(start, "%d %lf %lf %lf %lf %lf %lf", &key.frame,
+                   &key.translation.x, &key.translation.y, &key.translation.z,
+                   &key.rotation.x, &key.rotation.y, &key.rotation.z) != 7 || key.frame < 0) {
+            printf("Bad camera key on line %d of %s\n", line_number, filename);
+            continue;
+        }
+        if (path->keys_added == path->num_keys) {
+            path->num_keys *= 2;
+            path->keys = engine_realloc(path->keys, sizeof(CameraKey)*path->num_keys, MEMORY_OTHER);
+        }
+        path->keys[path->keys_added] = key;
+        path->keys_added += 1;
+    }
+    fclose(file);
+    qsort(path->keys, path->keys_added, sizeof(CameraKey), compare_camera_keys);
+    return path;
+}
+
+void free_camera_path(CameraPath* path) {
+    engine_free(path->keys);
+    engine_free(path);
+}
+
+Vector3 lerp_vector(Vector3 a, Vector3 b, double t) {
+    Vector3 out;
+    out.x = a.x + (b.x - a.x)*t;
+    out.y = a.y + (b.y - a.y)*t;
+    out.z = a.z + (b.z - a.z)*t;
+    return out;
+}
+
+void camera_at(CameraPath* path, int frame, Vector3* translation, Vector3* rotation) {
+    int i = 1;
+    while (i < path->keys_added - 1 && path->keys[i].frame < frame) { i++; }
+    CameraKey* a = &(path->keys[path->keys_added > 1 ? i - 1 : 0]);
+    CameraKey* b = &(path->keys[path->keys_added > 1 ? i : 0]);
+    double t = b->frame > a->frame ? (double)(frame - a->frame)/(b->frame - a->frame) : 0;
+    if (t < 0) { t = 0; } else if (t > 1) { t = 1; }
+    *translation = lerp_vector(a->translation, b->translation, t);
+    *rotation = lerp_vector(a->rotation, b->rotation, t);
+}
+
+//Blocking counterpart of update_streaming for offline renders, returns once every chunk the camera needs is in the world
+void finish_streaming(ChunkStreamer* streamer, World* world, Vector3* rotation, Vector3* translation) {
+    int i, pending = 1;
+    while (pending) {
+        update_streaming(streamer, world, rotation, translation);
+        SDL_LockMutex(streamer->lock);
+        pending = 0;
+        for (i = 0; i < streamer->chunks_added && !pending; i++) {
+            pending = streamer->chunks[i]->state != CHUNK_RESIDENT;
+        }
+        SDL_UnlockMutex(streamer->lock);
+        if (pending) { SDL_Delay(1); }
+    }
+}
+
+//BT.601 limited range, full resolution chroma (y4m C444)
+void argb_to_yuv444(Uint32* pixels, int n, Uint8* yuv) {
+    Uint8* y = yuv;
+    Uint8* u = yuv + n;
+    Uint8* v = yuv + 2*n;
+    int i, r, g, b;
+    for (i = 0; i < n; i++) {
+        r = (pixels[i] >> 16) & 255;
+        g = (pixels[i] >> 8) & 255;
+        b = pixels[i] & 255;
+        y[i] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+        u[i] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+        v[i] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+    }
+}
+
+int batch_worker_thread(void* data) {
+    BatchWorker* worker = data;
+    BatchRenderer* batch = worker->batch;
+    World* world = worker->scene->world;
+    Framebuffer* fb = worker->fb;
+    Vector3 translation, rotation;
+    Uint32* tmp;
+    int frame;
+    while (1) {
+        //Don't run further ahead of the writer than the window, or the slot would still be in use
+        SDL_LockMutex(batch->lock);
+        while (batch->next_frame < batch->end_frame && batch->next_frame >= batch->next_write + batch->window) {
+            SDL_CondWait(batch->changed, batch->lock);
+        }
+        frame = batch->next_frame;
+        if (frame < batch->end_frame) { batch->next_frame += 1; }
+        SDL_UnlockMutex(batch->lock);
+        if (frame >= batch->end_frame) { break; }
+
+        camera_at(batch->path, frame, &translation, &rotation);
+        animate_demo_scene(worker->scene, frame);
+        if (worker->streamer != NULL) {
+            finish_streaming(worker->streamer, world, &rotation, &translation);
+        }
+        clear_framebuffer(fb, 0xff1e1e1e);
+        rotate_all_in_world(world, rotation, translation);
+        render_world(fb, world, &translation);
+
+        //The slot is ours until ready is set, nobody else maps to it inside the window
+        BatchSlot* slot = &(batch->slots[frame % batch->window]);
+        tmp = slot->pixels;
+        slot->pixels = fb->pixels;
+        fb->pixels = tmp;
+        if (slot->yuv != NULL) {
+            argb_to_yuv444(slot->pixels, fb->width*fb->height, slot->yuv);
+        }
+        SDL_LockMutex(batch->lock);
+        slot->ready = 1;
+        SDL_CondBroadcast(batch->changed);
+        SDL_UnlockMutex(batch->lock);
+    }
+    return 0;
+}
+
+//Render a camera path without a window. Frames go to out_dir as frame_NNNNN.bmp, or to stdout as a y4m
+//stream when out_dir is NULL. Frames are independent so they spread over every core; the writer takes
+//them back in order through a window of 2 frames per worker.
+int run_batch(char* path_file, char* out_dir, int threads, int fps, char* chunk_directory, size_t chunk_budget, char* snapshot_path) {
+    FILE* video = NULL;
+    if (out_dir == NULL) {
+        //stdout carries the video, everything print() says goes to stderr instead
+        fflush(stdout);
+        int video_fd = dup(1);
+        dup2(2, 1);
+        video = fdopen(video_fd, "wb");
+    }
+    CameraPath* path = load_camera_path(path_file);
+    if (path == NULL || path->keys_added == 0) {
+        printf("No camera keys in %s\n", path_file);
+        if (path != NULL) { free_camera_path(path); }
+        if (video != NULL) { fclose(video); }
+        return 1;
+    }
+    if (threads < 1) { threads = SDL_GetCPUCount(); }
+
+    BatchRenderer batch;
+    batch.path = path;
+    batch.chunk_directory = chunk_directory;
+    //Every worker streams its own copy of the cells around its camera, so they split the budget
+    //rather than each taking all of it. Cells in range are never evicted, whatever the budget.
+    batch.chunk_budget = chunk_budget/threads;
+    batch.end_frame = path->keys[path->keys_added - 1].frame + 1;
+    batch.window = 2*threads;
+    batch.lock = SDL_CreateMutex();
+    batch.changed = SDL_CreateCond();
+    batch.next_frame = path->keys[0].frame;
+    batch.next_write = batch.next_frame;
+    batch.slots = engine_malloc(sizeof(BatchSlot)*batch.window, MEMORY_OTHER);
+    int i, frame;
+    for (i = 0; i < batch.window; i++) {
+        batch.slots[i].pixels = engine_malloc(sizeof(Uint32)*WIDTH*HEIGHT, MEMORY_FRAME);
+        batch.slots[i].yuv = video != NULL ? engine_malloc(3*WIDTH*HEIGHT, MEMORY_FRAME) : NULL;
+        batch.slots[i].ready = 0;
+    }
+
+    //Scenes are built here rather than on the workers, texture setup isn't thread safe
+    BatchWorker* workers = engine_malloc(sizeof(BatchWorker)*threads, MEMORY_OTHER);
+    for (i = 0; i < threads; i++) {
+        workers[i].batch = &batch;
+        workers[i].scene = open_demo_scene(snapshot_path, i == 0); //The first one writes it if needed, the rest share its pages
+        workers[i].fb = create_framebuffer(WIDTH, HEIGHT);
+        //No occlusion culling: a worker's previous frame isn't the one before this one
+        workers[i].scene->world->occlusion = NULL;
+        workers[i].streamer = chunk_directory != NULL ? create_chunk_streamer(chunk_directory, batch.chunk_budget) : NULL;
+    }
+    //Workers own next_frame once they start
+    printf("Rendering frames %d to %d on %d threads\n", path->keys[0].frame, batch.end_frame - 1, threads);
+    for (i = 0; i < threads; i++) {
+        workers[i].thread = SDL_CreateThread(batch_worker_thread, "batch render", &workers[i]);
+    }
+
+    if (video != NULL) {
+        fprintf(video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", WIDTH, HEIGHT, fps);
+    }
+    int ok = 1;
+    char filename[1024];
+    Uint32 start = SDL_GetTicks();
+    for (frame = batch.next_write; frame < batch.end_frame; frame++) {
+        BatchSlot* slot = &(batch.slots[frame % batch.window]);
+        SDL_LockMutex(batch.lock);
+        while (!slot->ready) {
+            SDL_CondWait(batch.changed, batch.lock);
+        }
+        SDL_UnlockMutex(batch.lock);
+        //Workers can't claim frame + window until next_write moves, so the slot can be written unlocked
+        if (ok && video != NULL) {
+            fprintf(video, "FRAME\n");
+            ok = fwrite(slot->yuv, 1, 3*WIDTH*HEIGHT, video) == (size_t)(3*WIDTH*HEIGHT);
+        } else if (ok) {
+            snprintf(filename, sizeof(filename), "%s/frame_%05d.bmp", out_dir, frame);
+            SDL_Surface* surface = SDL_CreateRGBSurfaceFrom(slot->pixels, WIDTH, HEIGHT, 32, WIDTH*sizeof(Uint32),
+                                                            0x00ff0000, 0x0000ff00, 0x000000ff, 0);
+            ok = surface != NULL && SDL_SaveBMP(surface, filename) == 0;
+            SDL_FreeSurface(surface);
+        }
+        if (!ok) {
+            printf("Could not write frame %d, skipping the rest\n", frame);
+        }
+        SDL_LockMutex(batch.lock);
+        slot->ready = 0;
+        batch.next_write = frame + 1;
+        SDL_CondBroadcast(batch.changed);
+        SDL_UnlockMutex(batch.lock);
+    }
+    double seconds = (SDL_GetTicks() - start)/1000.0;
+    printf("%d frames in %.2f s\n", batch.end_frame - path->keys[0].frame, seconds);
+
+    for (i = 0; i < threads; i++) {
+        SDL_WaitThread(workers[i].thread, NULL);
+        if (workers[i].streamer != NULL) {
+            free_chunk_streamer(workers[i].streamer, workers[i].scene->world);
+        }
+        free_framebuffer(workers[i].fb);
+        free_demo_scene(workers[i].scene);
+    }
+    for (i = 0; i < batch.window; i++) {
+        engine_free(batch.slots[i].pixels);
+        engine_free(batch.slots[i].yuv);
+    }
+    engine_free(batch.slots);
+    engine_free(workers);
+    SDL_DestroyCond(batch.changed);
+    SDL_DestroyMutex(batch.lock);
+    free_camera_path(path);
+    print_memory_stats();
+    if (video != NULL) { fclose(video); }
+    return ok ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
     int FRAME_LIMIT = 1000/300;
-    int move_speed = 10;
-    SDL_Color white = { 255, 255, 255 };        
-    Vector3 zero; zero.x = 0; zero.y = 0; zero.z = 0;
+    double move_speed = 600; //World units per second while an arrow key is held
+    double turn_speed = 0.03; //Radians per second for a and d
+    char* chunk_directory = NULL;
+    size_t chunk_budget = 256*1024*1024;
+    char* batch_path = NULL; //Camera path file, renders headless when set
+    char* batch_out = NULL; //Image directory, NULL streams y4m to stdout
+    int batch_threads = 0; //0 uses every core
+    int batch_fps = 30;
+    int capture_slots = 0; //Frames in the capture ring, 0 for no capture
+    int measure_latency = 0;
+    char* snapshot_path = NULL; //Scene snapshot, loaded if it exists and written if it doesn't
+    init_morton_table(); //Before batch workers start, so they only ever read it
+
+    int arg;
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--make-chunks") == 0 && arg + 1 < argc) {
+            write_demo_chunks(argv[arg + 1], 8);
+            print("Chunks written");
+            return 0;
+        } else if (strcmp(argv[arg], "--chunks") == 0 && arg + 1 < argc) {
+            chunk_directory = argv[++arg];
+        } else if (strcmp(argv[arg], "--chunk-budget") == 0 && arg + 1 < argc) {
+            chunk_budget = (size_t)atoi(argv[++arg])*1024*1024; //MB
+        } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+            batch_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--out") == 0 && arg + 1 < argc) {
+            batch_out = argv[++arg];
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            batch_threads = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc) {
+            batch_fps = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--capture") == 0 && arg + 1 < argc) {
+            capture_slots = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 1 < argc) {
+            snapshot_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--latency") == 0) {
+            measure_latency = 1;
+        }
+    }
+
+    if (batch_path != NULL) {
+        SDL_Init(0);
+        int status = run_batch(batch_path, batch_out, batch_threads, batch_fps, chunk_directory, chunk_budget, snapshot_path);
+        SDL_Quit();
+        return status;
+    }
 
     if (SDL_Init(SDL_INIT_VIDEO) == 0) {
         SDL_Window* window = NULL;
@@ -493,36 +4088,14 @@ int main(int argc, char* argv[]) {
         if (SDL_CreateWindowAndRenderer(WIDTH, HEIGHT, 0, &window, &renderer) == 0) {
             print("Window created. Setting up...");
 
-            if (TTF_Init() < 0) {
-                // Error handling code
-                print("TTF init failed, exiting");
-                exit(0);
-            }
+            DemoScene* scene = open_demo_scene(snapshot_path, 1);
+            World* world = scene->world;
+            int frame = 0;
 
-            TTF_Font* font = TTF_OpenFont("/usr/share/fonts/TTF/arial.ttf", 20);
-            if (font == NULL) {
-                print("Font is null, exiting");
-                exit(0);
+            ChunkStreamer* streamer = NULL;
+            if (chunk_directory != NULL) {
+                streamer = create_chunk_streamer(chunk_directory, chunk_budget);
             }
-            print("Fonts initialized");
-
-            Mesh* axes = create_axes_mesh();
-
-            Mesh* cube = create_cube_mesh(100, 100, 100, 400, 100, 100, &white);
-            Mesh* cube1 = create_cube_mesh(200, 100, 100, 100, 400, 100, &white);
-            Mesh* cube2 = create_cube_mesh(200, 100, 100, 100, 100, 400, &white);
-            Mesh* cube3 = create_cube_mesh(100, 300, 100, 400, 100, 100, &white);
-            Mesh* cube4 = create_cube_mesh(200, 300, 100, 100, 400, 100, &white);
-            Mesh* cube5 = create_cube_mesh(200, 300, 100, 100, 100, 400, &white);
-
-            World* world = create_world(7);
-            add_mesh(world, axes);
-            add_mesh(world, cube);
-            add_mesh(world, cube1);
-            add_mesh(world, cube2);
-            add_mesh(world, cube3);
-            add_mesh(world, cube4);
-            add_mesh(world, cube5);
 
             Vector3 subject_translation; subject_translation.x = 0; subject_translation.y = 0; subject_translation.z = 3000;
             Vector3 subject_rotation; subject_rotation.x = 0; subject_rotation.y = 0; subject_rotation.z = 0;
@@ -570,101 +4143,183 @@ int main(int argc, char* argv[]) {
             SDL_bool done = SDL_FALSE;
 
             char fps_chars[200];
-            SDL_Surface* textSurface = TTF_RenderText_Blended(font, "???? FPS x: ???? y: ???? z: ????", white);
-            SDL_Texture* message = SDL_CreateTextureFromSurface(renderer, textSurface);
-            SDL_Rect textLocation = { 0, 0, 0, 0 };
-            textLocation.w = textSurface->w;
-            textLocation.h = textSurface->h;
+            //2D HUD, composited into the framebuffer after the 3D pass
+            Overlay* overlay = create_overlay();
+            OverlayElement* fps_label = add_overlay_label(overlay, 4, 2, WIDTH - 8, 20, "???? FPS x: ???? y: ???? z: ????");
+            OverlayElement* help_label = add_overlay_label(overlay, 4, HEIGHT - 24, WIDTH - 8, 14, "arrows move, a/d turn, w wireframe, g shading");
+            help_label->color[0] = 0.7; help_label->color[1] = 0.7; help_label->color[2] = 0.7;
+            add_overlay_element(overlay, WIDTH/2 - 24, HEIGHT/2 - 24, 48, 48, draw_crosshair, NULL);
+            OverlayElement* hover_label = add_overlay_label(overlay, 4, 26, WIDTH - 8, 14, ""); //What the mouse is over
+            char hover_chars[200];
+            OverlayElement* memory_label = add_overlay_label(overlay, 4, 42, WIDTH - 8, 14, ""); //Should stay flat while running
+            memory_label->color[0] = 0.7; memory_label->color[1] = 0.7; memory_label->color[2] = 0.7;
+            char memory_chars[256];
+            MemoryStats memory;
+            Uint64 last_allocations = 0;
 
             #define FPS_INTERVAL 1.0 //seconds.
             Uint32 fps_lasttime = SDL_GetTicks(); //the last recorded time.
             Uint32 fps_current; //the current FPS.
             Uint32 fps_frames = 0; //frames passed since the last recorded fps. At the tick of a second this will capture the number of frames rendered during that second
 
+            //Everything 3D is rasterized in software into fb, then uploaded once per frame
+            Framebuffer* fb = create_framebuffer(WIDTH, HEIGHT);
+            world->occlusion = create_depth_pyramid(WIDTH, HEIGHT);
+            SDL_Texture* fb_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+
+            CaptureRing* capture = NULL;
+            if (capture_slots > 0) {
+                capture = create_capture_ring(fb, capture_slots);
+                if (capture->fd >= 0) {
+                    printf("Capturing to /proc/%d/fd/%d, %d slots\n", (int)getpid(), capture->fd, capture_slots);
+                } else {
+                    printf("Capturing to memory, %d slots\n", capture_slots);
+                }
+            }
+
+            LatencyHistogram latency;
+            memset(&latency, 0, sizeof(latency));
+            Uint32 pending_input[MAX_PENDING_INPUT]; //Timestamps of input events that reach this frame
+            int num_pending_input = 0;
+            Uint64 last_counter = SDL_GetPerformanceCounter();
+
             //Main game loop
             print("Starting game loop...");
             while (!done) {
                 SDL_Event event;
 
-                SDL_SetRenderDrawColor(renderer, 30, 30, 30, SDL_ALPHA_OPAQUE);
-                SDL_RenderClear(renderer); //I think this just clears the screen
-
-                //SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE); //Set draw color to white
-
-                cube1->rotation.x += 0.0001;
-                cube1->rotation.y += 0.0001;
-                cube1->rotation.z += 0.0001;
-
-                
-                rotate_all_in_world(world, subject_rotation, subject_translation); //Perform rotations based on subject location
-                render_world(renderer, world, &subject_translation);
-
-                SDL_RenderCopy(renderer, message, NULL, &textLocation); //Render fps display
-
-                SDL_RenderPresent(renderer); //Not sure exactly what this does but it's important
-
-                fps_frames++;
-                if (fps_lasttime < SDL_GetTicks() - FPS_INTERVAL*1000) { //We have hit a second: now display the number of frames that were rendered during that second
-                    fps_lasttime = SDL_GetTicks();
-                    fps_current = fps_frames;
-                    fps_frames = 0;
-                    sprintf(fps_chars, "%d FPS x: %.2f y: %.2f z: %.2f", fps_current, subject_translation.x, subject_translation.y, subject_translation.z);
-                    textSurface = TTF_RenderText_Blended(font, fps_chars, white);
-                    message = SDL_CreateTextureFromSurface(renderer, textSurface);
-                    textLocation.w = textSurface->w;
-                    textLocation.h = textSurface->h;
-                }
-
+                //Input is sampled right before the transform stage so it lands in the frame being built,
+                //not the one after. Held keys are read from the keyboard state and scaled by the frame time.
+                Uint64 counter = SDL_GetPerformanceCounter();
+                double dt = (double)(counter - last_counter)/SDL_GetPerformanceFrequency();
+                last_counter = counter;
+                if (dt > 0.1) { dt = 0.1; } //Don't jump after a stall
                 while (SDL_PollEvent(&event)) {
                     switch(event.type) {
                         case SDL_QUIT:
                             done = SDL_TRUE;
                             break;
                         case SDL_KEYDOWN:
+                        case SDL_KEYUP:
+                            if (measure_latency && !event.key.repeat && num_pending_input < MAX_PENDING_INPUT) {
+                                pending_input[num_pending_input] = event.key.timestamp;
+                                num_pending_input += 1;
+                            }
+                            if (event.type == SDL_KEYUP || event.key.repeat) { break; } //Toggles flip once per press
                             switch( event.key.keysym.sym ){
-                                case SDLK_LEFT:
-                                    //print("Left");
-                                    subject_translation.x -= move_speed; //Will need to implement move forward based on direction
-                                    break;
-                                case SDLK_RIGHT:
-                                    //print("Right");
-                                    subject_translation.x += move_speed;
-                                    break;
-                                case SDLK_UP:
-                                    //print("Up");
-                                    subject_translation.z -= move_speed;
-                                    break;
-                                case SDLK_DOWN:
-                                    //print("Down");
-                                    subject_translation.z += move_speed;
+                                case SDLK_w:
+                                    world->wireframe = !world->wireframe;
                                     break;
-                                case SDLK_a:
-                                    //print("a");
-                                    subject_rotation.y -= 0.001;
-                                    break;
-                                case SDLK_d:
-                                    //print("d");
-                                    subject_rotation.y += 0.001;
+                                case SDLK_g:
+                                    world->shading = world->shading == SHADE_FLAT ? SHADE_GOURAUD : SHADE_FLAT;
                                     break;
                                 default:
                                     break;
                             }
                             break;
-                        case SDL_KEYUP:
-                            break;
                         default:
                             break;
                     }
                 }
+                const Uint8* keys = SDL_GetKeyboardState(NULL);
+                if (keys[SDL_SCANCODE_LEFT]) { subject_translation.x -= move_speed*dt; } //Will need to implement move forward based on direction
+                if (keys[SDL_SCANCODE_RIGHT]) { subject_translation.x += move_speed*dt; }
+                if (keys[SDL_SCANCODE_UP]) { subject_translation.z -= move_speed*dt; }
+                if (keys[SDL_SCANCODE_DOWN]) { subject_translation.z += move_speed*dt; }
+                if (keys[SDL_SCANCODE_A]) { subject_rotation.y -= turn_speed*dt; }
+                if (keys[SDL_SCANCODE_D]) { subject_rotation.y += turn_speed*dt; }
+
+                if (capture != NULL) {
+                    capture_acquire(capture, fb);
+                }
+                clear_framebuffer(fb, 0xff1e1e1e);
+
+                //SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE); //Set draw color to white
+
+                SDL_LockMutex(world->lock); //Ray queries wait while the scene changes
+                animate_demo_scene(scene, frame);
+                frame++;
+
+                
+                if (streamer != NULL) {
+                    update_streaming(streamer, world, &subject_rotation, &subject_translation);
+                }
+                rotate_all_in_world(world, subject_rotation, subject_translation); //Perform rotations based on subject location
+                SDL_UnlockMutex(world->lock);
+
+                int mouse_x, mouse_y;
+                SDL_GetMouseState(&mouse_x, &mouse_y);
+                RayHit hover = pick_screen(world, subject_rotation, subject_translation, mouse_x + 0.5, mouse_y + 0.5);
+                if (hover.mesh != NULL) {
+                    sprintf(hover_chars, "polygon %d at %.0f %.0f %.0f", hover.polygon, hover.point.x, hover.point.y, hover.point.z);
+                } else {
+                    hover_chars[0] = 0;
+                }
+                set_overlay_text(hover_label, hover_chars);
+
+                render_world(fb, world, &subject_translation);
+                composite_overlay(overlay, fb);
+
+                SDL_UpdateTexture(fb_texture, NULL, fb->pixels, fb->width*sizeof(Uint32));
+                if (capture != NULL) {
+                    capture_publish(capture);
+                }
+                SDL_RenderCopy(renderer, fb_texture, NULL, NULL);
+
+                SDL_RenderPresent(renderer); //Not sure exactly what this does but it's important
+
+                //Measured to when present returns, event timestamps are SDL_GetTicks milliseconds
+                if (num_pending_input > 0) {
+                    Uint32 presented = SDL_GetTicks();
+                    int i;
+                    for (i = 0; i < num_pending_input; i++) {
+                        record_latency(&latency, presented - pending_input[i]);
+                    }
+                    num_pending_input = 0;
+                }
+
+                fps_frames++;
+                if (fps_lasttime < SDL_GetTicks() - FPS_INTERVAL*1000) { //We have hit a second: now display the number of frames that were rendered during that second
+                    fps_lasttime = SDL_GetTicks();
+                    fps_current = fps_frames;
+                    fps_frames = 0;
+                    sprintf(fps_chars, "%d FPS x: %.2f y: %.2f z: %.2f culled: %d", fps_current, subject_translation.x, subject_translation.y, subject_translation.z, world->meshes_culled);
+                    if (capture != NULL) { //Consumer falling behind shows up here before it shows up in the video
+                        sprintf(fps_chars + strlen(fps_chars), " capture backlog: %d dropped: %d", capture_backlog(capture), SDL_AtomicGet(&(capture->header->dropped)));
+                    }
+                    if (measure_latency && latency.samples > 0) {
+                        sprintf(fps_chars + strlen(fps_chars), " input p95: %u ms", latency_percentile(&latency, 0.95));
+                    }
+                    set_overlay_text(fps_label, fps_chars);
+                    get_memory_stats(&memory);
+                    format_memory_stats(&memory, memory_chars, sizeof(memory_chars));
+                    Uint64 allocations = 0;
+                    int category;
+                    for (category = 0; category < MEMORY_CATEGORIES; category++) { allocations += memory.total_allocations[category]; }
+                    snprintf(memory_chars + strlen(memory_chars), sizeof(memory_chars) - strlen(memory_chars), " allocations/s: %llu", (unsigned long long)(allocations - last_allocations));
+                    last_allocations = allocations;
+                    set_overlay_text(memory_label, memory_chars);
+                }
+
                 //For now we want to see what the max framerate is, so comment out the delay
                 //SDL_Delay(FRAME_LIMIT);
             } //end game loop
             print("Cleaning up..."); //hopefully this gets everything
-            SDL_FreeSurface(textSurface);
-            SDL_DestroyTexture(message);
-            free_world(world);
-            TTF_CloseFont(font);
-            TTF_Quit();
+            if (measure_latency) {
+                print_latency(&latency);
+            }
+            free_overlay(overlay);
+            SDL_DestroyTexture(fb_texture);
+            if (capture != NULL) {
+                free_capture_ring(capture, fb);
+            }
+            free_framebuffer(fb);
+            free_depth_pyramid(world->occlusion);
+            if (streamer != NULL) {
+                free_chunk_streamer(streamer, world);
+            }
+            free_demo_scene(scene);
+            print_memory_stats(); //Anything still live here is a leak
         } //end if
         if (renderer) {
             SDL_DestroyRenderer(renderer);